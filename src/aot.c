@@ -0,0 +1,94 @@
+#include "aot.h"
+#include "cpu.h"
+#include "mmu.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define REG_BOOT 0xFF50
+
+uint32_t aot_rom_hash(const uint8_t *rom, size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= rom[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+AOT *aot_create(CPU *cpu, const AotProgram *program) {
+  if (cpu->rom == NULL ||
+      aot_rom_hash(cpu->rom, cpu->rom_size) != program->rom_hash) {
+    fprintf(stderr, "The AOT program was made from a different ROM.\n");
+    return NULL;
+  }
+
+  AOT *aot = malloc(sizeof(AOT));
+  if (aot == NULL)
+    return NULL;
+  aot->program = program;
+  aot->lookup = calloc(program->bank_count, sizeof(*aot->lookup));
+  if (aot->lookup == NULL) {
+    free(aot);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < program->block_count; i++) {
+    const AotBlock *block = &program->blocks[i];
+    const AotBlock **table = aot->lookup[block->bank];
+    if (table == NULL) {
+      table = calloc(ROM_BANK_SIZE, sizeof(*table));
+      if (table == NULL) {
+        aot_destroy(aot);
+        return NULL;
+      }
+      aot->lookup[block->bank] = table;
+    }
+    table[block->address % ROM_BANK_SIZE] = block;
+  }
+  return aot;
+}
+
+void aot_destroy(AOT *aot) {
+  if (aot == NULL)
+    return;
+  for (size_t i = 0; i < aot->program->bank_count; i++)
+    free(aot->lookup[i]);
+  free(aot->lookup);
+  free(aot);
+}
+
+static const AotBlock *find_block(CPU *cpu) {
+  AOT *aot = cpu->aot;
+  uint16_t pc = cpu->PC;
+
+  // Blocks are cartridge code, the boot ROM covers the first page (and
+  // 0x200 - 0x8FF on CGB) until it is unmapped. Their cycle counts are for
+  // normal speed.
+  int boot = cpu->memory[REG_BOOT] == 0 &&
+             (pc < 0x100 || (cpu->cgb && pc >= 0x200 && pc < 0x900));
+  if (pc >= 2 * ROM_BANK_SIZE || boot || cpu->speed_shift)
+    return NULL;
+
+  // Same bank selection as the MBC, ROMs without banking keep bank 1
+  size_t bank = 0;
+  if (pc >= ROM_BANK_SIZE) {
+    size_t banks = cpu->rom_size / ROM_BANK_SIZE;
+    bank = banks < 2 ? 1 : cpu->rom_bank % banks;
+    if (bank == 0 || bank >= aot->program->bank_count)
+      return NULL;
+  }
+
+  const AotBlock **table = aot->lookup[bank];
+  return table != NULL ? table[pc % ROM_BANK_SIZE] : NULL;
+}
+
+int aot_step(CPU *cpu) {
+  const AotBlock *block = find_block(cpu);
+  if (block == NULL) {
+    step(cpu);
+    return 1;
+  }
+  block->run(cpu);
+  return block->instructions;
+}
@@ -0,0 +1,44 @@
+#ifndef AOT_NEOSAHADEO
+#define AOT_NEOSAHADEO
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// Runtime for ROMs translated to C ahead of time by the recompiler. Code
+// the recompiler did not reach runs through the interpreter.
+
+struct CPU;
+
+typedef struct AotBlock {
+  uint16_t bank; // 0 for 0x0000 - 0x3FFF, the switchable bank otherwise
+  uint16_t address;
+  uint16_t instructions;
+  void (*run)(struct CPU *cpu);
+} AotBlock;
+
+// Emitted by the recompiler, one per translated ROM
+typedef struct AotProgram {
+  uint32_t rom_hash; // FNV-1a of the whole ROM the blocks were made from
+  size_t bank_count;
+  const AotBlock *blocks;
+  size_t block_count;
+} AotProgram;
+
+typedef struct AOT {
+  const AotProgram *program;
+  // Per bank tables indexed by the address within the 16 KiB window, NULL
+  // for banks without blocks
+  const AotBlock ***lookup;
+} AOT;
+
+uint32_t aot_rom_hash(const uint8_t *rom, size_t size);
+
+// NULL when the program was not made from the loaded ROM
+AOT *aot_create(struct CPU *cpu, const AotProgram *program);
+void aot_destroy(AOT *aot);
+
+// Run one translated block, or a single instruction through the
+// interpreter. Returns the number of guest instructions in what was run.
+int aot_step(struct CPU *cpu);
+
+#endif
@@ -0,0 +1,667 @@
+#include "apu.h"
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Register offsets from 0xFF10
+#define NR10 0x00
+#define NR11 0x01
+#define NR12 0x02
+#define NR13 0x03
+#define NR14 0x04
+#define NR21 0x06
+#define NR22 0x07
+#define NR23 0x08
+#define NR24 0x09
+#define NR30 0x0A
+#define NR31 0x0B
+#define NR32 0x0C
+#define NR33 0x0D
+#define NR34 0x0E
+#define NR41 0x10
+#define NR42 0x11
+#define NR43 0x12
+#define NR44 0x13
+#define NR50 0x14
+#define NR51 0x15
+#define NR52 0x16
+#define WAVE_RAM 0x20
+
+#define SQUARE1_BASE NR10
+#define SQUARE2_BASE (NR21 - 1)
+
+#define CPU_CLOCK 4194304
+#define SEQUENCER_PERIOD 8192 // 512 Hz
+
+#define BLEP_PHASE_BITS 5
+#define BLEP_PHASES (1 << BLEP_PHASE_BITS)
+#define BLEP_BITS 15
+#define BLEP_CUTOFF 0.9
+#define BASS_SHIFT 9
+#define AMPLITUDE_SCALE 64
+
+enum { CHANNEL_SQUARE1, CHANNEL_SQUARE2, CHANNEL_WAVE, CHANNEL_NOISE };
+
+static const uint8_t duty_table[4][8] = {
+    {0, 0, 0, 0, 0, 0, 0, 1}, // 12.5%
+    {1, 0, 0, 0, 0, 0, 0, 1}, // 25%
+    {1, 0, 0, 0, 0, 1, 1, 1}, // 50%
+    {0, 1, 1, 1, 1, 1, 1, 0}, // 75%
+};
+
+static const uint8_t noise_divisors[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+// Wave channel volume codes: mute, 100%, 50%, 25%
+static const uint8_t wave_shifts[4] = {4, 0, 1, 2};
+
+// Band-limited step, one row per sub-sample phase. Built once from the main
+// thread in apu_init, the audio thread never touches it.
+static int32_t blep_kernel[BLEP_PHASES][BLEP_WIDTH];
+static int blep_kernel_ready;
+
+static void init_blep_kernel(void) {
+  for (int phase = 0; phase < BLEP_PHASES; phase++) {
+    double fraction = (double)phase / BLEP_PHASES;
+    double taps[BLEP_WIDTH];
+    double sum = 0;
+
+    // Blackman windowed sinc centred between the two middle taps
+    for (int k = 0; k < BLEP_WIDTH; k++) {
+      double t = k - (BLEP_WIDTH / 2 - 1) - fraction;
+      double x = M_PI * t * BLEP_CUTOFF;
+      double sinc = x == 0 ? 1 : sin(x) / x;
+      double window = 0.42 + 0.5 * cos(2 * M_PI * t / BLEP_WIDTH) +
+                      0.08 * cos(4 * M_PI * t / BLEP_WIDTH);
+      taps[k] = sinc * window;
+      sum += taps[k];
+    }
+
+    // Every row must integrate to exactly one step
+    int32_t total = 0;
+    for (int k = 0; k < BLEP_WIDTH; k++) {
+      blep_kernel[phase][k] = lround(taps[k] / sum * (1 << BLEP_BITS));
+      total += blep_kernel[phase][k];
+    }
+    blep_kernel[phase][BLEP_WIDTH / 2] += (1 << BLEP_BITS) - total;
+  }
+  blep_kernel_ready = 1;
+}
+
+static void add_delta(APU *apu, uint64_t cycle, int side, int32_t delta) {
+  uint64_t position =
+      (cycle - apu->origin_cycle) * apu->ratio + apu->origin_fraction;
+  size_t index = position >> 32;
+  int phase = (position >> (32 - BLEP_PHASE_BITS)) & (BLEP_PHASES - 1);
+
+  int32_t *out = &apu->buffers->delta[side][index];
+  const int32_t *kernel = blep_kernel[phase];
+  for (int k = 0; k < BLEP_WIDTH; k++)
+    out[k] += kernel[k] * delta;
+}
+
+// Set a channel level and emit a step for any change in the mixed output
+static void update_output(APU *apu, uint64_t cycle, int channel,
+                          uint8_t level) {
+  apu->output[channel] = level;
+  if (!apu->synthesize)
+    return;
+
+  uint8_t panning = apu->registers[NR51];
+  uint8_t volume = apu->registers[NR50];
+  int32_t left = 0;
+  int32_t right = 0;
+  for (int i = 0; i < 4; i++) {
+    if (panning & (0x10 << i))
+      left += apu->output[i];
+    if (panning & (0x01 << i))
+      right += apu->output[i];
+  }
+  left *= (((volume >> 4) & 0x07) + 1) * AMPLITUDE_SCALE;
+  right *= ((volume & 0x07) + 1) * AMPLITUDE_SCALE;
+
+  if (left != apu->amplitude[0]) {
+    add_delta(apu, cycle, 0, left - apu->amplitude[0]);
+    apu->amplitude[0] = left;
+  }
+  if (right != apu->amplitude[1]) {
+    add_delta(apu, cycle, 1, right - apu->amplitude[1]);
+    apu->amplitude[1] = right;
+  }
+}
+
+static uint16_t frequency(APU *apu, int base) {
+  return apu->registers[base + 3] | (apu->registers[base + 4] & 0x07) << 8;
+}
+
+static uint32_t square_period(APU *apu, int base) {
+  return (2048 - frequency(apu, base)) * 4;
+}
+
+static uint32_t wave_period(APU *apu) {
+  return (2048 - frequency(apu, NR30)) * 2;
+}
+
+static uint32_t noise_period(APU *apu) {
+  uint8_t nr43 = apu->registers[NR43];
+  return noise_divisors[nr43 & 0x07] << (nr43 >> 4);
+}
+
+static uint8_t square_level(APU *apu, Square *square, int base) {
+  if (!square->enabled)
+    return 0;
+  uint8_t duty = apu->registers[base + 1] >> 6;
+  return duty_table[duty][square->duty_position] ? square->volume : 0;
+}
+
+static uint8_t wave_level(APU *apu) {
+  if (!apu->wave.enabled)
+    return 0;
+  uint8_t byte = apu->registers[WAVE_RAM + apu->wave.position / 2];
+  uint8_t sample = apu->wave.position & 1 ? byte & 0x0F : byte >> 4;
+  return sample >> wave_shifts[(apu->registers[NR32] >> 5) & 0x03];
+}
+
+static uint8_t noise_level(APU *apu) {
+  if (!apu->noise.enabled)
+    return 0;
+  return apu->noise.lfsr & 1 ? 0 : apu->noise.volume;
+}
+
+// Without synthesis nobody observes the individual edges, jump over all of
+// them at once. Returns the number of edges skipped.
+static uint32_t skip_edges(uint32_t *timer, uint32_t period, uint32_t cycles) {
+  if (*timer >= cycles) {
+    *timer -= cycles;
+    return 0;
+  }
+  // Edges fall on timer, timer + period, ... strictly before cycles
+  uint32_t steps = (cycles - *timer - 1) / period + 1;
+  *timer = *timer + steps * period - cycles;
+  return steps;
+}
+
+// Channels run from apu->cycle for the given number of cycles, stepping from
+// edge to edge instead of ticking every cycle
+static void run_square(APU *apu, Square *square, int channel, int base,
+                       uint32_t cycles) {
+  if (!square->enabled)
+    return;
+
+  uint32_t period = square_period(apu, base);
+  if (!apu->synthesize) {
+    uint32_t steps = skip_edges(&square->timer, period, cycles);
+    square->duty_position = (square->duty_position + steps) & 0x07;
+    return;
+  }
+
+  uint32_t time = square->timer;
+  while (time < cycles) {
+    square->duty_position = (square->duty_position + 1) & 0x07;
+    update_output(apu, apu->cycle + time, channel,
+                  square_level(apu, square, base));
+    time += period;
+  }
+  square->timer = time - cycles;
+}
+
+static void run_wave(APU *apu, uint32_t cycles) {
+  Wave *wave = &apu->wave;
+  if (!wave->enabled)
+    return;
+
+  uint32_t period = wave_period(apu);
+  if (!apu->synthesize) {
+    uint32_t steps = skip_edges(&wave->timer, period, cycles);
+    wave->position = (wave->position + steps) & 0x1F;
+    return;
+  }
+
+  uint32_t time = wave->timer;
+  while (time < cycles) {
+    wave->position = (wave->position + 1) & 0x1F;
+    update_output(apu, apu->cycle + time, CHANNEL_WAVE, wave_level(apu));
+    time += period;
+  }
+  wave->timer = time - cycles;
+}
+
+static void clock_lfsr(Noise *noise, uint8_t narrow) {
+  uint16_t bit = (noise->lfsr ^ (noise->lfsr >> 1)) & 1;
+  noise->lfsr = (noise->lfsr >> 1) | bit << 14;
+  if (narrow)
+    noise->lfsr = (noise->lfsr & ~0x40) | bit << 6;
+}
+
+static void run_noise(APU *apu, uint32_t cycles) {
+  Noise *noise = &apu->noise;
+  if (!noise->enabled)
+    return;
+
+  uint32_t period = noise_period(apu);
+  uint8_t narrow = apu->registers[NR43] & 0x08;
+  if (!apu->synthesize) {
+    // The LFSR has no closed form, it is still clocked so the noise picks
+    // up where it would have been once synthesis is back on
+    uint32_t steps = skip_edges(&noise->timer, period, cycles);
+    while (steps--)
+      clock_lfsr(noise, narrow);
+    return;
+  }
+
+  uint32_t time = noise->timer;
+  while (time < cycles) {
+    clock_lfsr(noise, narrow);
+    update_output(apu, apu->cycle + time, CHANNEL_NOISE, noise_level(apu));
+    time += period;
+  }
+  noise->timer = time - cycles;
+}
+
+static void clock_length(APU *apu, uint8_t *enabled, uint8_t length_enabled,
+                         uint16_t *length, int channel) {
+  if (!length_enabled || *length == 0)
+    return;
+  if (--*length == 0) {
+    *enabled = 0;
+    update_output(apu, apu->cycle, channel, 0);
+  }
+}
+
+static void clock_envelope(uint8_t envelope, uint8_t *volume, uint8_t *timer) {
+  uint8_t period = envelope & 0x07;
+  if (period == 0 || (*timer > 0 && --*timer != 0))
+    return;
+  *timer = period;
+  if (envelope & 0x08 && *volume < 15)
+    (*volume)++;
+  else if (!(envelope & 0x08) && *volume > 0)
+    (*volume)--;
+}
+
+static uint16_t sweep_frequency(APU *apu) {
+  Square *square = &apu->square1;
+  uint8_t nr10 = apu->registers[NR10];
+  uint16_t delta = square->shadow_frequency >> (nr10 & 0x07);
+  uint16_t next = nr10 & 0x08 ? square->shadow_frequency - delta
+                              : square->shadow_frequency + delta;
+  if (next > 2047) {
+    square->enabled = 0;
+    update_output(apu, apu->cycle, CHANNEL_SQUARE1, 0);
+  }
+  return next;
+}
+
+static void clock_sweep(APU *apu) {
+  Square *square = &apu->square1;
+  if (--square->sweep_timer != 0)
+    return;
+
+  uint8_t nr10 = apu->registers[NR10];
+  uint8_t period = (nr10 >> 4) & 0x07;
+  square->sweep_timer = period ? period : 8;
+  if (!square->sweep_enabled || period == 0)
+    return;
+
+  uint16_t next = sweep_frequency(apu);
+  if (next <= 2047 && (nr10 & 0x07)) {
+    square->shadow_frequency = next;
+    apu->registers[NR13] = next & 0xFF;
+    apu->registers[NR14] = (apu->registers[NR14] & 0xF8) | next >> 8;
+    sweep_frequency(apu);
+  }
+}
+
+static void clock_sequencer(APU *apu) {
+  uint8_t step = apu->sequencer_step;
+  apu->sequencer_step = (step + 1) & 0x07;
+
+  if ((step & 1) == 0) {
+    clock_length(apu, &apu->square1.enabled, apu->square1.length_enabled,
+                 &apu->square1.length, CHANNEL_SQUARE1);
+    clock_length(apu, &apu->square2.enabled, apu->square2.length_enabled,
+                 &apu->square2.length, CHANNEL_SQUARE2);
+    clock_length(apu, &apu->wave.enabled, apu->wave.length_enabled,
+                 &apu->wave.length, CHANNEL_WAVE);
+    clock_length(apu, &apu->noise.enabled, apu->noise.length_enabled,
+                 &apu->noise.length, CHANNEL_NOISE);
+  }
+
+  if (step == 2 || step == 6)
+    clock_sweep(apu);
+
+  if (step == 7) {
+    clock_envelope(apu->registers[NR12], &apu->square1.volume,
+                   &apu->square1.envelope_timer);
+    clock_envelope(apu->registers[NR22], &apu->square2.volume,
+                   &apu->square2.envelope_timer);
+    clock_envelope(apu->registers[NR42], &apu->noise.volume,
+                   &apu->noise.envelope_timer);
+    update_output(apu, apu->cycle, CHANNEL_SQUARE1,
+                  square_level(apu, &apu->square1, SQUARE1_BASE));
+    update_output(apu, apu->cycle, CHANNEL_SQUARE2,
+                  square_level(apu, &apu->square2, SQUARE2_BASE));
+    update_output(apu, apu->cycle, CHANNEL_NOISE, noise_level(apu));
+  }
+}
+
+static void update_status(APU *apu) {
+  uint8_t status = apu->square1.enabled | apu->square2.enabled << 1 |
+                   apu->wave.enabled << 2 | apu->noise.enabled << 3;
+  apu->registers[NR52] = (apu->registers[NR52] & 0x80) | 0x70 | status;
+}
+
+static int16_t integrate(APU *apu, int side, size_t index) {
+  int32_t sample = apu->integrator[side] >> BLEP_BITS;
+  // Leaky integrator, the leak acts as a high-pass that removes DC. The
+  // sample may be negative, so it is scaled by multiplying.
+  apu->integrator[side] += apu->buffers->delta[side][index] -
+                           sample * (1 << (BLEP_BITS - BASS_SHIFT));
+
+  if (sample > INT16_MAX)
+    return INT16_MAX;
+  if (sample < INT16_MIN)
+    return INT16_MIN;
+  return sample;
+}
+
+// Convert every complete sample up to apu->cycle and push it to the ring
+static void flush_samples(APU *apu) {
+  if (!apu->synthesize) {
+    apu->origin_cycle = apu->cycle;
+    apu->origin_fraction = 0;
+    return;
+  }
+
+  uint64_t position = (apu->cycle - apu->origin_cycle) * apu->ratio +
+                      apu->origin_fraction;
+  size_t count = position >> 32;
+
+  AudioRing *ring = &apu->buffers->ring;
+  size_t write = atomic_load_explicit(&ring->write, memory_order_relaxed);
+  size_t read = atomic_load_explicit(&ring->read, memory_order_acquire);
+  size_t space = AUDIO_RING_FRAMES - (write - read);
+  size_t dropped = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    int16_t left = integrate(apu, 0, i);
+    int16_t right = integrate(apu, 1, i);
+    if (space == 0) {
+      dropped++;
+      continue;
+    }
+
+    size_t slot = (write & (AUDIO_RING_FRAMES - 1)) * 2;
+    ring->samples[slot] = left;
+    ring->samples[slot + 1] = right;
+    write++;
+    space--;
+  }
+  if (dropped > 0)
+    atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+  atomic_store_explicit(&ring->write, write, memory_order_release);
+
+  // Keep the tail of steps that spill past the last complete sample
+  for (int side = 0; side < 2; side++) {
+    int32_t *delta = apu->buffers->delta[side];
+    memmove(delta, delta + count, BLEP_WIDTH * sizeof(int32_t));
+    memset(delta + BLEP_WIDTH, 0, count * sizeof(int32_t));
+  }
+  apu->origin_cycle = apu->cycle;
+  apu->origin_fraction = position & 0xFFFFFFFF;
+}
+
+void apu_init(APU *apu, uint8_t *registers, AudioBuffers *buffers) {
+  if (!blep_kernel_ready)
+    init_blep_kernel();
+
+  memset(apu, 0, sizeof(APU));
+  apu->registers = registers;
+  apu->buffers = buffers;
+  apu->synthesize = buffers != NULL;
+  apu->sequencer_timer = SEQUENCER_PERIOD;
+  apu->noise.lfsr = 0x7FFF;
+  apu->base_ratio = ((uint64_t)APU_SAMPLE_RATE << 32) / CPU_CLOCK;
+  apu->ratio = apu->base_ratio;
+  if (buffers == NULL)
+    return;
+  memset(buffers->delta, 0, sizeof(buffers->delta));
+  atomic_init(&buffers->ring.read, 0);
+  atomic_init(&buffers->ring.write, 0);
+  atomic_init(&buffers->ring.underruns, 0);
+  atomic_init(&buffers->ring.overruns, 0);
+}
+
+void apu_run_to(APU *apu, uint64_t cycle) {
+  while (apu->cycle < cycle) {
+    uint64_t end = apu->cycle + apu->sequencer_timer;
+    if (end > cycle)
+      end = cycle;
+    uint32_t cycles = end - apu->cycle;
+
+    run_square(apu, &apu->square1, CHANNEL_SQUARE1, SQUARE1_BASE, cycles);
+    run_square(apu, &apu->square2, CHANNEL_SQUARE2, SQUARE2_BASE, cycles);
+    run_wave(apu, cycles);
+    run_noise(apu, cycles);
+
+    apu->cycle = end;
+    apu->sequencer_timer -= cycles;
+    if (apu->sequencer_timer == 0) {
+      apu->sequencer_timer = SEQUENCER_PERIOD;
+      clock_sequencer(apu);
+    }
+
+    // Long runs without a frame boundary must not overflow the step buffer
+    uint64_t pending = ((apu->cycle - apu->origin_cycle) * apu->ratio +
+                        apu->origin_fraction) >> 32;
+    if (pending > BLEP_BUFFER / 2)
+      flush_samples(apu);
+  }
+  update_status(apu);
+}
+
+static void trigger_square(APU *apu, Square *square, int channel, int base) {
+  uint8_t envelope = apu->registers[base + 2];
+  square->enabled = (envelope & 0xF8) != 0;
+  if (square->length == 0)
+    square->length = 64;
+  square->timer = square_period(apu, base);
+  square->volume = envelope >> 4;
+  square->envelope_timer = envelope & 0x07;
+
+  if (channel == CHANNEL_SQUARE1) {
+    uint8_t nr10 = apu->registers[NR10];
+    uint8_t period = (nr10 >> 4) & 0x07;
+    square->shadow_frequency = frequency(apu, base);
+    square->sweep_timer = period ? period : 8;
+    square->sweep_enabled = period != 0 || (nr10 & 0x07) != 0;
+    if (nr10 & 0x07)
+      sweep_frequency(apu);
+  }
+  update_output(apu, apu->cycle, channel, square_level(apu, square, base));
+}
+
+static void write_square(APU *apu, Square *square, int channel, int base,
+                         int reg, uint8_t value) {
+  switch (reg - base) {
+  case 1:
+    square->length = 64 - (value & 0x3F);
+    break;
+  case 2:
+    // Clearing the upper five bits turns the DAC off
+    if ((value & 0xF8) == 0) {
+      square->enabled = 0;
+      update_output(apu, apu->cycle, channel, 0);
+    }
+    break;
+  case 4:
+    square->length_enabled = (value & 0x40) != 0;
+    if (value & 0x80)
+      trigger_square(apu, square, channel, base);
+    break;
+  }
+}
+
+static void write_wave(APU *apu, int reg, uint8_t value) {
+  Wave *wave = &apu->wave;
+  switch (reg) {
+  case NR30:
+    if (!(value & 0x80)) {
+      wave->enabled = 0;
+      update_output(apu, apu->cycle, CHANNEL_WAVE, 0);
+    }
+    break;
+  case NR31:
+    wave->length = 256 - value;
+    break;
+  case NR32:
+    update_output(apu, apu->cycle, CHANNEL_WAVE, wave_level(apu));
+    break;
+  case NR34:
+    wave->length_enabled = (value & 0x40) != 0;
+    if (value & 0x80) {
+      wave->enabled = (apu->registers[NR30] & 0x80) != 0;
+      if (wave->length == 0)
+        wave->length = 256;
+      wave->timer = wave_period(apu);
+      wave->position = 0;
+      update_output(apu, apu->cycle, CHANNEL_WAVE, wave_level(apu));
+    }
+    break;
+  }
+}
+
+static void write_noise(APU *apu, int reg, uint8_t value) {
+  Noise *noise = &apu->noise;
+  switch (reg) {
+  case NR41:
+    noise->length = 64 - (value & 0x3F);
+    break;
+  case NR42:
+    if ((value & 0xF8) == 0) {
+      noise->enabled = 0;
+      update_output(apu, apu->cycle, CHANNEL_NOISE, 0);
+    }
+    break;
+  case NR44:
+    noise->length_enabled = (value & 0x40) != 0;
+    if (value & 0x80) {
+      uint8_t envelope = apu->registers[NR42];
+      noise->enabled = (envelope & 0xF8) != 0;
+      if (noise->length == 0)
+        noise->length = 64;
+      noise->timer = noise_period(apu);
+      noise->volume = envelope >> 4;
+      noise->envelope_timer = envelope & 0x07;
+      noise->lfsr = 0x7FFF;
+      update_output(apu, apu->cycle, CHANNEL_NOISE, noise_level(apu));
+    }
+    break;
+  }
+}
+
+static void power_off(APU *apu) {
+  memset(apu->registers, 0, NR52);
+  apu->square1.enabled = 0;
+  apu->square2.enabled = 0;
+  apu->wave.enabled = 0;
+  apu->noise.enabled = 0;
+  for (int channel = 0; channel < 4; channel++)
+    update_output(apu, apu->cycle, channel, 0);
+}
+
+void apu_write(APU *apu, uint64_t cycle, uint16_t address, uint8_t value) {
+  apu_run_to(apu, cycle);
+
+  int reg = address - 0xFF10;
+  // Only wave RAM and NR52 are writable while the APU is powered off
+  if (!(apu->registers[NR52] & 0x80) && reg < NR52)
+    return;
+
+  if (reg == NR52) {
+    apu->registers[NR52] = (apu->registers[NR52] & 0x7F) | (value & 0x80);
+    if (!(value & 0x80))
+      power_off(apu);
+    update_status(apu);
+    return;
+  }
+
+  apu->registers[reg] = value;
+  if (reg <= NR14)
+    write_square(apu, &apu->square1, CHANNEL_SQUARE1, SQUARE1_BASE, reg, value);
+  else if (reg <= NR24)
+    write_square(apu, &apu->square2, CHANNEL_SQUARE2, SQUARE2_BASE, reg, value);
+  else if (reg <= NR34)
+    write_wave(apu, reg, value);
+  else if (reg <= NR44)
+    write_noise(apu, reg, value);
+  else if (reg == NR50 || reg == NR51)
+    update_output(apu, apu->cycle, CHANNEL_SQUARE1, apu->output[0]);
+  update_status(apu);
+}
+
+void apu_end_frame(APU *apu, uint64_t cycle) {
+  apu_run_to(apu, cycle);
+  flush_samples(apu);
+}
+
+// Called from the audio thread, pads with silence on underrun
+size_t apu_read_samples(APU *apu, int16_t *out, size_t frames) {
+  if (apu->buffers == NULL) {
+    memset(out, 0, frames * 2 * sizeof(int16_t));
+    return 0;
+  }
+  AudioRing *ring = &apu->buffers->ring;
+  size_t read = atomic_load_explicit(&ring->read, memory_order_relaxed);
+  size_t write = atomic_load_explicit(&ring->write, memory_order_acquire);
+  size_t available = write - read;
+  size_t count = available < frames ? available : frames;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t slot = ((read + i) & (AUDIO_RING_FRAMES - 1)) * 2;
+    out[i * 2] = ring->samples[slot];
+    out[i * 2 + 1] = ring->samples[slot + 1];
+  }
+  if (count < frames) {
+    memset(out + count * 2, 0, (frames - count) * 2 * sizeof(int16_t));
+    atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+  }
+  atomic_store_explicit(&ring->read, read + count, memory_order_release);
+  return count;
+}
+
+size_t apu_buffered_frames(APU *apu) {
+  if (apu->buffers == NULL)
+    return 0;
+  AudioRing *ring = &apu->buffers->ring;
+  size_t write = atomic_load_explicit(&ring->write, memory_order_relaxed);
+  size_t read = atomic_load_explicit(&ring->read, memory_order_acquire);
+  return write - read;
+}
+
+// Scale the resampling ratio, pending steps are flushed first so samples
+// already positioned with the old ratio do not move
+void apu_set_rate(APU *apu, double factor) {
+  flush_samples(apu);
+  apu->ratio = apu->base_ratio * factor;
+}
+
+void apu_set_synthesis(APU *apu, int enabled, uint64_t cycle) {
+  apu_run_to(apu, cycle);
+  if (apu->buffers == NULL)
+    enabled = 0;
+  if (apu->synthesize == enabled)
+    return;
+
+  flush_samples(apu);
+  apu->synthesize = enabled;
+  if (!enabled)
+    return;
+
+  // Levels went stale while edges were skipped, step straight to them
+  apu->origin_cycle = apu->cycle;
+  apu->origin_fraction = 0;
+  apu->output[CHANNEL_SQUARE1] = square_level(apu, &apu->square1, SQUARE1_BASE);
+  apu->output[CHANNEL_SQUARE2] = square_level(apu, &apu->square2, SQUARE2_BASE);
+  apu->output[CHANNEL_WAVE] = wave_level(apu);
+  update_output(apu, apu->cycle, CHANNEL_NOISE, noise_level(apu));
+}
@@ -0,0 +1,104 @@
+#ifndef APU_NEOSAHADEO
+#define APU_NEOSAHADEO
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define APU_SAMPLE_RATE 48000
+#define AUDIO_RING_FRAMES 4096 // Stereo frames, must be a power of two
+
+#define BLEP_WIDTH 16     // Taps per band-limited step
+#define BLEP_BUFFER 4096  // Samples buffered before they are pushed out
+
+// Single producer (emulator) single consumer (audio callback) ring of
+// interleaved stereo samples
+typedef struct AudioRing {
+  int16_t samples[AUDIO_RING_FRAMES * 2];
+  atomic_size_t read;
+  atomic_size_t write;
+  atomic_size_t underruns;
+  atomic_size_t overruns;
+} AudioRing;
+
+// What synthesis writes, kept apart from the APU state. Contexts that
+// never synthesize go without.
+typedef struct AudioBuffers {
+  int32_t delta[2][BLEP_BUFFER + BLEP_WIDTH];
+  AudioRing ring;
+} AudioBuffers;
+
+typedef struct Square {
+  uint8_t enabled;
+  uint8_t length_enabled;
+  uint16_t length;
+  uint8_t duty_position;
+  uint8_t volume;
+  uint8_t envelope_timer;
+  uint32_t timer; // Cycles until the next duty step
+
+  // Frequency sweep, channel 1 only
+  uint8_t sweep_enabled;
+  uint8_t sweep_timer;
+  uint16_t shadow_frequency;
+} Square;
+
+typedef struct Wave {
+  uint8_t enabled;
+  uint8_t length_enabled;
+  uint16_t length;
+  uint8_t position;
+  uint32_t timer;
+} Wave;
+
+typedef struct Noise {
+  uint8_t enabled;
+  uint8_t length_enabled;
+  uint16_t length;
+  uint8_t volume;
+  uint8_t envelope_timer;
+  uint16_t lfsr;
+  uint32_t timer;
+} Noise;
+
+typedef struct APU {
+  uint8_t *registers; // 0xFF10 - 0xFF3F in the bus
+
+  // Channels are only advanced when a register is written or samples are
+  // requested, this is the cycle they have been run up to
+  uint64_t cycle;
+  uint32_t sequencer_timer;
+  uint8_t sequencer_step;
+
+  Square square1;
+  Square square2;
+  Wave wave;
+  Noise noise;
+
+  // Cleared while fast-forwarding: channels keep their timing, length,
+  // sweep and envelope state but no samples are synthesized
+  uint8_t synthesize;
+
+  uint8_t output[4]; // Current digital level of each channel
+  int32_t amplitude[2];
+
+  // Band-limited synthesis, sample positions are 32.32 fixed point
+  uint64_t ratio;      // Output samples per cycle
+  uint64_t base_ratio; // Nominal ratio before rate control
+  uint64_t origin_cycle;
+  uint64_t origin_fraction;
+  int32_t integrator[2];
+  AudioBuffers *buffers; // NULL keeps synthesis off
+} APU;
+
+// buffers belong to the caller and may be NULL, see AudioBuffers
+void apu_init(APU *apu, uint8_t *registers, AudioBuffers *buffers);
+void apu_run_to(APU *apu, uint64_t cycle);
+void apu_write(APU *apu, uint64_t cycle, uint16_t address, uint8_t value);
+void apu_end_frame(APU *apu, uint64_t cycle);
+size_t apu_read_samples(APU *apu, int16_t *out, size_t frames);
+size_t apu_buffered_frames(APU *apu);
+void apu_set_rate(APU *apu, double factor);
+void apu_set_synthesis(APU *apu, int enabled, uint64_t cycle);
+
+#endif
@@ -0,0 +1,97 @@
+#include "apu.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Checks that skipping channel edges while synthesis is off leaves every
+// channel exactly where synthesizing each edge does, including runs that
+// end right on a period boundary and synthesis being toggled mid run.
+
+// Square (2048 - 2044) * 4, wave (2048 - 2040) * 2 and noise with divisor 8
+// all step on multiples of this
+#define PERIOD 16
+#define RUNS 4096
+
+typedef struct Lane {
+  const char *name;
+  APU apu;
+  AudioBuffers buffers;
+  uint8_t registers[0x30];
+} Lane;
+
+static void start_channels(Lane *lane) {
+  APU *apu = &lane->apu;
+  apu_init(apu, lane->registers, &lane->buffers);
+  apu_write(apu, 0, 0xFF26, 0x80); // NR52, power on
+  apu_write(apu, 0, 0xFF25, 0xFF); // NR51, every channel on both sides
+  apu_write(apu, 0, 0xFF24, 0x77); // NR50
+
+  apu_write(apu, 0, 0xFF11, 0x80); // 50% duty
+  apu_write(apu, 0, 0xFF12, 0xF0); // Full volume, no envelope
+  apu_write(apu, 0, 0xFF13, 2044 & 0xFF);
+  apu_write(apu, 0, 0xFF14, 0x80 | 2044 >> 8);
+
+  apu_write(apu, 0, 0xFF1A, 0x80);
+  apu_write(apu, 0, 0xFF1C, 0x20);
+  apu_write(apu, 0, 0xFF1D, 2040 & 0xFF);
+  apu_write(apu, 0, 0xFF1E, 0x80 | 2040 >> 8);
+
+  apu_write(apu, 0, 0xFF21, 0xF0);
+  apu_write(apu, 0, 0xFF22, 0x00);
+  apu_write(apu, 0, 0xFF23, 0x80);
+}
+
+static int same_channels(const APU *a, const APU *b) {
+  return a->square1.duty_position == b->square1.duty_position &&
+         a->square1.timer == b->square1.timer &&
+         a->wave.position == b->wave.position &&
+         a->wave.timer == b->wave.timer && a->noise.lfsr == b->noise.lfsr &&
+         a->noise.timer == b->noise.timer;
+}
+
+static void print_channels(const Lane *lane) {
+  const APU *apu = &lane->apu;
+  fprintf(stderr,
+          "  %-11s square %u/%" PRIu32 " wave %u/%" PRIu32 " noise %04X/%" PRIu32
+          "\n",
+          lane->name, apu->square1.duty_position, apu->square1.timer,
+          apu->wave.position, apu->wave.timer, apu->noise.lfsr,
+          apu->noise.timer);
+}
+
+int main(void) {
+  static Lane synthesized = {.name = "synthesized"};
+  static Lane skipped = {.name = "skipped"};
+  static Lane toggled = {.name = "toggled"};
+  start_channels(&synthesized);
+  start_channels(&skipped);
+  start_channels(&toggled);
+  apu_set_synthesis(&skipped.apu, 0, 0);
+
+  // Every other run ends on a boundary of all three periods, the others
+  // a few cycles past one
+  uint64_t cycle = 0;
+  for (int i = 0; i < RUNS; i++) {
+    cycle += i & 1 ? PERIOD * (i % 7 + 1) : i % 5 + 1;
+    if (i % 3 == 0)
+      apu_set_synthesis(&toggled.apu, !toggled.apu.synthesize, cycle);
+
+    apu_end_frame(&synthesized.apu, cycle);
+    apu_end_frame(&skipped.apu, cycle);
+    apu_end_frame(&toggled.apu, cycle);
+    if (!same_channels(&synthesized.apu, &skipped.apu) ||
+        !same_channels(&synthesized.apu, &toggled.apu)) {
+      fprintf(stderr, "FAIL     apu edge skipping at cycle %" PRIu64 "\n",
+              cycle);
+      print_channels(&synthesized);
+      print_channels(&skipped);
+      print_channels(&toggled);
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("PASS     apu edge skipping over %d runs\n", RUNS);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+#include "audio.h"
+#include "apu.h"
+#include <SDL3/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define AUDIO_CHUNK_FRAMES 512
+
+static SDL_AudioStream *audio_stream;
+
+// Runs on the SDL audio thread. Samples are copied out of the APU ring
+// through a stack buffer into the stream, whose queue was primed by
+// audio_open so that it has chunks to reuse.
+static void SDLCALL audio_callback(void *userdata, SDL_AudioStream *stream,
+                                   int additional_amount, int total_amount) {
+  APU *apu = userdata;
+  int16_t chunk[AUDIO_CHUNK_FRAMES * 2];
+  int frames = additional_amount / (int)(2 * sizeof(int16_t));
+
+  while (frames > 0) {
+    int count = frames < AUDIO_CHUNK_FRAMES ? frames : AUDIO_CHUNK_FRAMES;
+    apu_read_samples(apu, chunk, count);
+    SDL_PutAudioStreamData(stream, chunk, count * 2 * sizeof(int16_t));
+    frames -= count;
+  }
+}
+
+int audio_open(APU *apu) {
+  if (!SDL_InitSubSystem(SDL_INIT_AUDIO)) {
+    fprintf(stderr, "Failed to initialize audio: %s\n", SDL_GetError());
+    return -1;
+  }
+
+  SDL_AudioSpec spec;
+  spec.format = SDL_AUDIO_S16;
+  spec.channels = 2;
+  spec.freq = APU_SAMPLE_RATE;
+
+  audio_stream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK,
+                                           &spec, audio_callback, apu);
+  if (audio_stream == NULL) {
+    fprintf(stderr, "Failed to open audio device: %s\n", SDL_GetError());
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    return -1;
+  }
+
+  // SDL3 queues stream data in chunks and keeps the ones it frees in a
+  // pool for the next put. Queueing and dropping more silence than any
+  // callback asks for, before the device starts, fills that pool, so the
+  // callback reuses chunks instead of allocating them.
+  static const int16_t silence[AUDIO_RING_FRAMES * 2];
+  SDL_PutAudioStreamData(audio_stream, silence, sizeof(silence));
+  SDL_ClearAudioStream(audio_stream);
+
+  SDL_ResumeAudioStreamDevice(audio_stream);
+  return 0;
+}
+
+void audio_close(void) {
+  if (audio_stream == NULL)
+    return;
+  SDL_DestroyAudioStream(audio_stream);
+  audio_stream = NULL;
+  SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
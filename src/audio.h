@@ -0,0 +1,9 @@
+#ifndef AUDIO_NEOSAHADEO
+#define AUDIO_NEOSAHADEO
+
+#include "apu.h"
+
+int audio_open(APU *apu);
+void audio_close(void);
+
+#endif
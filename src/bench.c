@@ -0,0 +1,462 @@
+#include "aot.h"
+#include "cpu.h"
+#include "jit.h"
+#include "mmu.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Microbenchmarks for the opcode handlers and whole ROM runs.
+//
+// Results are printed as JSON so they can be stored per commit and diffed.
+// Host IPC is read from perf counters and reported as null when the kernel
+// does not allow access to them.
+
+#define HANDLER_ITERATIONS (1 << 20)
+#define RANDOM_STATES 1024
+#define CODE_ADDRESS 0xC000
+#define BOOT_ROM_CYCLE_LIMIT (8 * 1024 * 1024)
+#define SYNTHETIC_CYCLE_LIMIT (64 * 1024 * 1024)
+
+// Cartridge code built only from implemented opcodes, so it runs to the end
+// on every engine. 256 passes copy a rotated byte over 256 bytes of WRAM,
+// with a push, call and pop per byte, then stop at SYNTHETIC_END.
+static const uint8_t synthetic_program[] = {
+    0x31, 0xFE, 0xFF, // 0100 LD SP, 0xFFFE
+    0x11, 0x00, 0xC8, // 0103 LD DE, 0xC800
+    0x0E, 0x00,       // 0106 LD C, 0x00
+    0x21, 0x00, 0xC0, // 0108 LD HL, 0xC000
+    0x06, 0x00,       // 010B LD B, 0x00
+    0x1A,             // 010D LD A, (DE)
+    0x17,             // 010E RLA
+    0x22,             // 010F LD (HL+), A
+    0xC5,             // 0110 PUSH BC
+    0xCD, 0x1C, 0x01, // 0111 CALL 0x011C
+    0xC1,             // 0114 POP BC
+    0x05,             // 0115 DEC B
+    0x20, 0xF5,       // 0116 JR NZ, 0x010D
+    0x0C,             // 0118 INC C
+    0x20, 0xED,       // 0119 JR NZ, 0x0108
+    0x00,             // 011B NOP, end of the run
+    0xCB, 0x7C,       // 011C BIT 7, H
+    0xC9,             // 011E RET
+};
+#define SYNTHETIC_END 0x011B
+
+typedef enum {
+  ENGINE_INTERPRETER,
+  ENGINE_JIT,
+  ENGINE_AOT, // Blocks translated by the recompiler, see build-aot
+} Engine;
+
+static const char *engine_names[] = {"interpreter", "jit", "aot"};
+
+#ifdef AOT_PROGRAM
+extern const AotProgram aot_program;
+#endif
+
+typedef struct Counters {
+  int instructions_fd;
+  int cycles_fd;
+} Counters;
+
+typedef struct State {
+  uint16_t BC;
+  uint16_t DE;
+  uint16_t HL;
+  uint16_t AF;
+  uint16_t SP;
+} State;
+
+typedef struct RomResult {
+  int finished; // Set once the run reached its goal or the cycle limit
+  uint64_t instructions;
+  uint64_t cycles;
+  uint16_t pc;
+  long long elapsed_ns;
+  double host_ipc;
+} RomResult;
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t xorshift32(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static int open_counter(uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = group_fd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void open_counters(Counters *counters) {
+  counters->instructions_fd = open_counter(PERF_COUNT_HW_INSTRUCTIONS, -1);
+  counters->cycles_fd = -1;
+  if (counters->instructions_fd != -1)
+    counters->cycles_fd =
+        open_counter(PERF_COUNT_HW_CPU_CYCLES, counters->instructions_fd);
+}
+
+static void start_counters(Counters *counters) {
+  if (counters->cycles_fd == -1)
+    return;
+  ioctl(counters->instructions_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(counters->instructions_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+// Returns host instructions per cycle, or a negative value when unavailable
+static double stop_counters(Counters *counters) {
+  if (counters->cycles_fd == -1)
+    return -1;
+  ioctl(counters->instructions_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  uint64_t instructions = 0;
+  uint64_t cycles = 0;
+  if (read(counters->instructions_fd, &instructions, sizeof(instructions)) !=
+          sizeof(instructions) ||
+      read(counters->cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles) ||
+      cycles == 0)
+    return -1;
+  return (double)instructions / cycles;
+}
+
+static void print_ipc(double ipc) {
+  if (ipc < 0)
+    printf("null");
+  else
+    printf("%.3f", ipc);
+}
+
+static void load_state(CPU *cpu, const State *state) {
+  cpu->BC = state->BC;
+  cpu->DE = state->DE;
+  cpu->HL = state->HL;
+  cpu->AF = state->AF;
+  cpu->SP = state->SP;
+  cpu->PC = CODE_ADDRESS;
+}
+
+// Time ITERATIONS calls of one handler, cycling through the random states.
+// A NULL handler measures the cost of the loop and state reload alone.
+static double time_handler(CPU *cpu, opcode_function handler, State *states,
+                           Counters *counters, double *ipc) {
+  start_counters(counters);
+  long long start = current_time_ns();
+  for (int i = 0; i < HANDLER_ITERATIONS; i++) {
+    load_state(cpu, &states[i & (RANDOM_STATES - 1)]);
+    if (handler != NULL)
+      handler(cpu);
+    __asm__ volatile("" ::: "memory");
+  }
+  long long elapsed = current_time_ns() - start;
+  *ipc = stop_counters(counters);
+  return (double)elapsed / HANDLER_ITERATIONS;
+}
+
+static void bench_table(CPU *cpu, const char *table_name,
+                        opcode_function *table, const uint8_t *cycles,
+                        State *states, Counters *counters, double overhead,
+                        int *first) {
+  for (int opcode = 0; opcode < 256; opcode++) {
+    opcode_function handler = table[opcode];
+    if (handler == not_implemented || handler == prefix)
+      continue;
+
+    double ipc;
+    double ns = time_handler(cpu, handler, states, counters, &ipc) - overhead;
+    if (ns < 0)
+      ns = 0;
+
+    printf("%s\n    {\"table\": \"%s\", \"opcode\": \"0x%02X\", "
+           "\"ns_per_op\": %.3f, \"emulated_cycles\": %u, \"host_ipc\": ",
+           *first ? "" : ",", table_name, opcode, ns, cycles[opcode]);
+    print_ipc(ipc);
+    printf("}");
+    *first = 0;
+  }
+}
+
+static void bench_handlers(Counters *counters) {
+  CPU cpu;
+  uint8_t *memory = calloc(65536, sizeof(uint8_t)); // 64KiB
+  initialize_cpu(&cpu, memory);
+
+  // Random operands for immediate loads, branches and calls
+  for (int i = 0; i < 3; i++)
+    memory[CODE_ADDRESS + i] = xorshift32();
+
+  // LDH writes go to HRAM rather than the I/O registers
+  memory[CODE_ADDRESS + 1] = 0x80 | (memory[CODE_ADDRESS + 1] & 0x7E);
+
+  // Keep HL and SP inside WRAM and C on HRAM so stores hit plain memory,
+  // not DMA, LCD or sound registers
+  State states[RANDOM_STATES];
+  for (int i = 0; i < RANDOM_STATES; i++) {
+    states[i].BC = (xorshift32() & 0xFF00) | 0x80 | (xorshift32() & 0x7E);
+    states[i].DE = xorshift32();
+    states[i].HL = 0xC100 + (xorshift32() & 0x0FFF);
+    states[i].AF = xorshift32() & 0xFFF0;
+    states[i].SP = 0xC100 + (xorshift32() & 0x0FFE);
+  }
+
+  double overhead_ipc;
+  double overhead =
+      time_handler(&cpu, NULL, states, counters, &overhead_ipc);
+
+  printf("  \"iterations\": %d,\n", HANDLER_ITERATIONS);
+  printf("  \"loop_overhead_ns\": %.3f,\n", overhead);
+  printf("  \"handlers\": [");
+  int first = 1;
+  bench_table(&cpu, "opcode", opcode_table, opcode_cycles, states, counters,
+              overhead, &first);
+  bench_table(&cpu, "special", special_opcode_table, special_opcode_cycles,
+              states, counters, overhead, &first);
+  printf("\n  ],\n");
+
+  destroy_cpu(&cpu);
+}
+
+// Worker state for the exit hook
+static RomResult *current_result;
+static CPU *current_cpu;
+static long long current_start;
+
+// Runs on an unimplemented opcode, and from exit() when the worker gives up
+// early, so the report points at where the run stopped
+static void record_crash(void) {
+  if (current_result->finished)
+    return;
+  current_result->cycles = current_cpu->cycles;
+  current_result->pc = current_cpu->PC - 1;
+  current_result->elapsed_ns = current_time_ns() - current_start;
+}
+
+// Run a whole ROM in a child process, a crash can't take the report down.
+// Without a ROM or boot ROM the synthetic program runs.
+static void run_rom(RomResult *result, const char *boot_rom, const char *rom,
+                    uint64_t max_cycles, Engine engine) {
+  // Counters opened by the parent measure the parent, not this worker
+  Counters counters;
+  open_counters(&counters);
+
+  CPU cpu;
+  uint8_t *memory = calloc(65536, sizeof(uint8_t)); // 64KiB
+  initialize_cpu(&cpu, memory);
+
+  if (rom != NULL) {
+    uint8_t *buffer = NULL;
+    size_t size = 0;
+    read_to_buffer(rom, &buffer, &size);
+    load_cartridge(&cpu, buffer, size);
+    post_boot_state(&cpu);
+  } else if (boot_rom != NULL) {
+    size_t size = 0;
+    read_to_buffer(boot_rom, &cpu.memory, &size);
+  } else {
+    uint8_t *buffer = calloc(2 * ROM_BANK_SIZE, sizeof(uint8_t));
+    if (buffer == NULL) {
+      perror("Failed to allocate the synthetic cartridge.");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(buffer + 0x100, synthetic_program, sizeof(synthetic_program));
+    load_cartridge(&cpu, buffer, 2 * ROM_BANK_SIZE);
+    cpu.PC = 0x0100;
+    cpu.memory[0xFF50] = 0x01;
+  }
+
+  if (engine == ENGINE_JIT) {
+    cpu.jit = jit_create(0);
+    if (cpu.jit == NULL)
+      exit(EXIT_FAILURE);
+  }
+#ifdef AOT_PROGRAM
+  if (engine == ENGINE_AOT) {
+    cpu.aot = aot_create(&cpu, &aot_program);
+    if (cpu.aot == NULL)
+      exit(EXIT_FAILURE);
+  }
+#endif
+
+  // The boot ROM is done once it reaches the cartridge entry point, the
+  // synthetic program at its last instruction
+  int ends = rom == NULL;
+  uint16_t end_pc = boot_rom != NULL ? 0x0100 : SYNTHETIC_END;
+
+  current_result = result;
+  current_cpu = &cpu;
+  atexit(record_crash);
+
+  start_counters(&counters);
+  long long start = current_time_ns();
+  current_start = start;
+  uint64_t dispatches = 0;
+  while (cpu.cycles < max_cycles && !(ends && cpu.PC == end_pc) &&
+         !cpu.fault) {
+    if (cpu.aot != NULL)
+      result->instructions += aot_step(&cpu);
+    else if (cpu.jit != NULL)
+      result->instructions += jit_step(&cpu);
+    else {
+      step(&cpu);
+      result->instructions++;
+    }
+
+    // Publish progress so a run killed by a signal still reports how far
+    // it got
+    if ((++dispatches & 0xFFF) == 0) {
+      result->cycles = cpu.cycles;
+      result->pc = cpu.PC;
+      result->elapsed_ns = current_time_ns() - start;
+    }
+  }
+  result->elapsed_ns = current_time_ns() - start;
+  result->host_ipc = stop_counters(&counters);
+  if (cpu.fault) {
+    record_crash();
+  } else {
+    result->cycles = cpu.cycles;
+    result->pc = cpu.PC;
+    result->finished = cpu.cycles < max_cycles || !ends ? 1 : 2;
+  }
+
+  aot_destroy(cpu.aot);
+  jit_destroy(cpu.jit);
+  destroy_cpu(&cpu);
+}
+
+static void bench_rom(const char *name, const char *boot_rom, const char *rom,
+                      uint64_t max_cycles, Engine engine, int first) {
+  RomResult *result = mmap(NULL, sizeof(RomResult), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (result == MAP_FAILED) {
+    perror("Failed to map benchmark result.");
+    exit(EXIT_FAILURE);
+  }
+  memset(result, 0, sizeof(RomResult));
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("Failed to fork benchmark worker.");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    // Keep execution traces out of the JSON
+    freopen("/dev/null", "w", stdout);
+    run_rom(result, boot_rom, rom, max_cycles, engine);
+    exit(EXIT_SUCCESS);
+  }
+  waitpid(pid, NULL, 0);
+
+  const char *status = result->finished == 1   ? "complete"
+                       : result->finished == 2 ? "cycle_limit"
+                                               : "crash";
+  double ns_per_instruction =
+      result->instructions ? (double)result->elapsed_ns / result->instructions
+                           : 0;
+
+  printf("%s\n    {\"name\": \"%s\", \"engine\": \"%s\", \"status\": \"%s\", "
+         "\"instructions\": "
+         "%" PRIu64 ", \"cycles\": %" PRIu64 ", \"pc\": \"0x%04X\", "
+         "\"elapsed_ns\": %lld, "
+         "\"ns_per_instruction\": %.3f, \"host_ipc\": ",
+         first ? "" : ",", name, engine_names[engine], status,
+         result->instructions, result->cycles,
+         result->pc, result->elapsed_ns, ns_per_instruction);
+  if (result->finished)
+    print_ipc(result->host_ipc);
+  else
+    printf("null");
+  printf("}");
+
+  munmap(result, sizeof(RomResult));
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-b boot rom] [-f frames] [-j] [-a] [rom]\n"
+          "  -b  also run a boot ROM up to the cartridge entry point\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *boot_rom = NULL;
+  long frames = 600;
+  int use_jit = 0;
+  int use_aot = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:f:ja")) != -1) {
+    switch (opt) {
+    case 'b':
+      boot_rom = optarg;
+      break;
+    case 'f':
+      frames = strtol(optarg, NULL, 10);
+      break;
+    case 'j':
+      use_jit = 1;
+      break;
+#ifdef AOT_PROGRAM
+    case 'a':
+      use_aot = 1;
+      break;
+#endif
+    default:
+      usage(argv[0]);
+    }
+  }
+  const char *rom = optind < argc ? argv[optind] : NULL;
+
+  Counters counters;
+  open_counters(&counters);
+
+  printf("{\n");
+  bench_handlers(&counters);
+
+  printf("  \"roms\": [");
+  // Every ROM also runs on the selected engines so the JSON has the
+  // comparison. The AOT program is made from a cartridge, not the built in
+  // workloads.
+  bench_rom("synthetic", NULL, NULL, SYNTHETIC_CYCLE_LIMIT,
+            ENGINE_INTERPRETER, 1);
+  if (use_jit)
+    bench_rom("synthetic", NULL, NULL, SYNTHETIC_CYCLE_LIMIT, ENGINE_JIT, 0);
+  if (boot_rom != NULL) {
+    bench_rom("boot_rom", boot_rom, NULL, BOOT_ROM_CYCLE_LIMIT,
+              ENGINE_INTERPRETER, 0);
+    if (use_jit)
+      bench_rom("boot_rom", boot_rom, NULL, BOOT_ROM_CYCLE_LIMIT, ENGINE_JIT,
+                0);
+  }
+  if (rom != NULL) {
+    uint64_t max_cycles = (uint64_t)frames * CYCLES_PER_FRAME;
+    bench_rom(rom, boot_rom, rom, max_cycles, ENGINE_INTERPRETER, 0);
+    if (use_jit)
+      bench_rom(rom, boot_rom, rom, max_cycles, ENGINE_JIT, 0);
+    if (use_aot)
+      bench_rom(rom, boot_rom, rom, max_cycles, ENGINE_AOT, 0);
+  }
+  printf("\n  ]\n}\n");
+
+  return 0;
+}
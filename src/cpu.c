@@ -1,4 +1,7 @@
 #include "cpu.h"
+#include "aot.h"
+#include "jit.h"
+#include "mmu.h"
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -15,7 +18,9 @@
 #define H_POS 5
 #define C_POS 4
 
-uint8_t fetch_byte(CPU *cpu) { return cpu->memory[cpu->PC++]; }
+#define REG_KEY1 0xFF4D // Speed switch
+
+uint8_t fetch_byte(CPU *cpu) { return mmu_read(cpu, cpu->PC++); }
 
 uint16_t fetch_word(CPU *cpu) {
   uint8_t low = fetch_byte(cpu);
@@ -23,22 +28,16 @@ uint16_t fetch_word(CPU *cpu) {
   return high << 8 | low;
 }
 
-typedef void (*opcode_function)(CPU *cpu);
-typedef void (*special_opcode_function)(CPU *cpu);
-void prefix(CPU *cpu);
-
-void not_implemented(CPU *cpu) {
-  printf("Instruction not implemented: %02x\n\n", cpu->memory[cpu->PC - 1]);
-  exit(EXIT_FAILURE);
-}
+// The host decides what to do about it, the core may be embedded
+void not_implemented(CPU *cpu) { cpu->fault = 1; }
 
 uint8_t get_first_reg(uint16_t reg) { return reg >> 8; }
 uint8_t get_last_reg(uint16_t reg) { return reg & 0x00FF; }
 
-uint8_t get_z_flag(uint8_t f_reg) { return f_reg & 0x80 >> Z_POS; };
-uint8_t get_n_flag(uint8_t f_reg) { return f_reg & 0x40 >> N_POS; };
-uint8_t get_h_flag(uint8_t f_reg) { return f_reg & 0x20 >> H_POS; };
-uint8_t get_c_flag(uint8_t f_reg) { return f_reg & 0x10 >> C_POS; };
+uint8_t get_z_flag(uint8_t f_reg) { return (f_reg & FLAG_Z) >> Z_POS; };
+uint8_t get_n_flag(uint8_t f_reg) { return (f_reg & FLAG_N) >> N_POS; };
+uint8_t get_h_flag(uint8_t f_reg) { return (f_reg & FLAG_H) >> H_POS; };
+uint8_t get_c_flag(uint8_t f_reg) { return (f_reg & FLAG_C) >> C_POS; };
 
 void update_flags(CPU *cpu, uint8_t mask, uint8_t flags) {
   uint8_t f_reg = get_last_reg(cpu->AF);
@@ -49,15 +48,26 @@ void update_flags(CPU *cpu, uint8_t mask, uint8_t flags) {
 
 void nop(CPU *cpu) {};
 
-void stop_n8(CPU *cpu) {};
+// STOP with KEY1 armed switches a CGB between normal and double speed
+void stop_n8(CPU *cpu) {
+  if (!cpu->cgb || !(cpu->memory[REG_KEY1] & 0x01))
+    return;
+  cpu->speed_shift ^= 1;
+  cpu->memory[REG_KEY1] = 0;
+  // Compiled blocks carry cycle counts for the old speed
+  if (cpu->jit != NULL)
+    jit_invalidate(cpu->jit, 0x0000, 0x10000);
+};
 
 void jr_nz_e8(CPU *cpu) {
   uint8_t f_reg = get_last_reg(cpu->AF);
   uint8_t z_flag = get_z_flag(f_reg);
 
-  if (z_flag == 1) {
-    int8_t value = (int8_t)fetch_byte(cpu);
+  // The displacement is always consumed, even when the branch is not taken
+  int8_t value = (int8_t)fetch_byte(cpu);
+  if (z_flag == 0) {
     cpu->PC += value;
+    cpu->cycles += 4 >> cpu->speed_shift;
   }
 };
 
@@ -74,11 +84,12 @@ void ld_a_n8(CPU *cpu) {
 
 void ldh_a8_a(CPU *cpu) {
   uint8_t value = fetch_byte(cpu);
-  cpu->memory[0xFF00 + value] = get_last_reg(cpu->AF);
+  mmu_write(cpu, 0xFF00 + value, get_first_reg(cpu->AF));
 }
 
 void xor_a_a(CPU *cpu) {
-  // Set Z flag and reset rest
+  // A ^ A is always zero: set Z flag and reset rest
+  cpu->AF = cpu->AF & 0x00FF;
   update_flags(cpu, FLAG_ALL, FLAG_Z);
 }
 
@@ -89,7 +100,7 @@ void ld_hl_n16(CPU *cpu) {
 
 void ld_hld_a(CPU *cpu) {
   uint8_t a_reg = get_first_reg(cpu->AF);
-  cpu->memory[cpu->HL] = a_reg;
+  mmu_write(cpu, cpu->HL, a_reg);
   cpu->HL--;
 }
 
@@ -97,25 +108,26 @@ void bit_7_h(CPU *cpu) {
   uint8_t f_reg = get_last_reg(cpu->AF);
   uint8_t h_reg = get_first_reg(cpu->HL);
 
-  uint8_t z_flag = (h_reg >> 7 & 1 ? FLAG_Z : 0x00);
-  update_flags(cpu, FLAG_Z, z_flag);
+  // Z is set when the tested bit is 0
+  uint8_t z_flag = (h_reg >> 7 & 1 ? 0x00 : FLAG_Z);
+  update_flags(cpu, FLAG_Z | FLAG_N | FLAG_H, z_flag | FLAG_H);
 }
 
 void ei(CPU *cpu) {
-  // Set IME flag at 0xFFFF
-  cpu->memory[0xFFFF] = 1;
+  // IME is internal to the CPU, 0xFFFF is the IE register
+  cpu->ime = 1;
 }
 
 void ld_c_n8(CPU *cpu) {
   uint8_t value = fetch_byte(cpu);
   uint8_t b_reg = get_first_reg(cpu->BC);
-  cpu->BC = b_reg | value;
+  cpu->BC = b_reg << 8 | value;
 }
 
 void ldh_c_a(CPU *cpu) {
   uint8_t a_reg = get_first_reg(cpu->AF);
   uint8_t c_reg = get_last_reg(cpu->BC);
-  cpu->memory[0xFF00 + c_reg] = a_reg;
+  mmu_write(cpu, 0xFF00 + c_reg, a_reg);
 }
 
 void inc_c(CPU *cpu) {
@@ -141,7 +153,7 @@ void inc_h(CPU *cpu) {
   uint8_t z_flag = h_reg == 0 ? FLAG_Z : 0x00;
 
   update_flags(cpu, FLAG_H | FLAG_Z | FLAG_N, h_flag | z_flag);
-  cpu->BC = h_reg << 8 | l_reg;
+  cpu->HL = h_reg << 8 | l_reg;
 }
 
 void inc_d(CPU *cpu) {
@@ -154,7 +166,7 @@ void inc_d(CPU *cpu) {
   uint8_t z_flag = d_reg == 0 ? FLAG_Z : 0x00;
 
   update_flags(cpu, FLAG_H | FLAG_Z | FLAG_N, h_flag | z_flag);
-  cpu->BC = d_reg << 8 | e_reg;
+  cpu->DE = d_reg << 8 | e_reg;
 }
 
 void inc_e(CPU *cpu) {
@@ -167,7 +179,7 @@ void inc_e(CPU *cpu) {
   uint8_t z_flag = e_reg == 0 ? FLAG_Z : 0x00;
 
   update_flags(cpu, FLAG_H | FLAG_Z | FLAG_N, h_flag | z_flag);
-  cpu->BC = d_reg << 8 | e_reg;
+  cpu->DE = d_reg << 8 | e_reg;
 }
 
 void inc_b(CPU *cpu) {
@@ -180,7 +192,7 @@ void inc_b(CPU *cpu) {
   uint8_t z_flag = b_reg == 0 ? FLAG_Z : 0x00;
 
   update_flags(cpu, FLAG_H | FLAG_Z | FLAG_N, h_flag | z_flag);
-  cpu->BC = c_reg << 8 | c_reg;
+  cpu->BC = b_reg << 8 | c_reg;
 }
 
 void inc_l(CPU *cpu) {
@@ -193,12 +205,12 @@ void inc_l(CPU *cpu) {
   uint8_t z_flag = l_reg == 0 ? FLAG_Z : 0x00;
 
   update_flags(cpu, FLAG_H | FLAG_Z | FLAG_N, h_flag | z_flag);
-  cpu->BC = h_reg << 8 | l_reg;
+  cpu->HL = h_reg << 8 | l_reg;
 }
 
 void ld_hl_a(CPU *cpu) {
   uint8_t a_reg = get_first_reg(cpu->AF);
-  cpu->memory[cpu->HL] = a_reg;
+  mmu_write(cpu, cpu->HL, a_reg);
 }
 
 void ld_de_a(CPU *cpu) {
@@ -208,7 +220,7 @@ void ld_de_a(CPU *cpu) {
 
 void ld_a_de(CPU *cpu) {
   uint8_t a_reg = get_first_reg(cpu->AF);
-  a_reg = cpu->memory[cpu->DE];
+  a_reg = mmu_read(cpu, cpu->DE);
   cpu->AF = a_reg << 8 | cpu->AF & 0x00FF;
 }
 
@@ -217,9 +229,9 @@ void call_a16(CPU *cpu) {
   uint16_t return_addr = cpu->PC;
 
   cpu->SP--;
-  cpu->memory[cpu->SP] = return_addr >> 8; // high
+  mmu_write(cpu, cpu->SP, return_addr >> 8); // high
   cpu->SP--;
-  cpu->memory[cpu->SP] = return_addr & 0x00FF; // low
+  mmu_write(cpu, cpu->SP, return_addr & 0x00FF); // low
 
   // implicit n16 jump
   cpu->PC = value;
@@ -267,13 +279,13 @@ void rla(CPU *cpu) {
   c_flag = bit_7_a << C_POS;
 
   update_flags(cpu, FLAG_Z | FLAG_H | FLAG_N | FLAG_C, c_flag);
-  cpu->AF = f_reg << 8 | a_reg;
+  cpu->AF = a_reg << 8 | get_last_reg(cpu->AF);
 }
 
 void pop_bc(CPU *cpu) {
-  uint8_t low = cpu->memory[cpu->SP];
+  uint8_t low = mmu_read(cpu, cpu->SP);
   cpu->SP++;
-  uint8_t high = cpu->memory[cpu->SP];
+  uint8_t high = mmu_read(cpu, cpu->SP);
   cpu->SP++;
 
   cpu->BC = high << 8 | low;
@@ -281,44 +293,45 @@ void pop_bc(CPU *cpu) {
 
 void dec_b(CPU *cpu) {
   uint8_t b_reg = get_first_reg(cpu->BC);
-  uint8_t bit_4_b = b_reg & 0x10;
+  // Half borrow when the low nibble wraps from 0 to F
+  uint8_t h_flag = (b_reg & 0x0F) == 0x00 ? FLAG_H : 0x00;
   b_reg--;
-  uint8_t h_flag = (b_reg & 0x10) == bit_4_b ? 0x00 : FLAG_H;
   uint8_t z_flag = b_reg == 0 ? FLAG_Z : 0x00;
   update_flags(cpu, FLAG_Z | FLAG_H | FLAG_N, z_flag | h_flag | FLAG_N);
+  cpu->BC = b_reg << 8 | get_last_reg(cpu->BC);
 }
 
 void push_bc(CPU *cpu) {
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->BC >> 8; // High
+  mmu_write(cpu, cpu->SP, cpu->BC >> 8); // High
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->BC & 0x00FF; // Low
+  mmu_write(cpu, cpu->SP, cpu->BC & 0x00FF); // Low
 }
 
 void push_af(CPU *cpu) {
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->AF >> 8; // High
+  mmu_write(cpu, cpu->SP, cpu->AF >> 8); // High
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->AF & 0x00FF; // Low
+  mmu_write(cpu, cpu->SP, cpu->AF & 0x00FF); // Low
 }
 
 void push_de(CPU *cpu) {
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->DE >> 8; // High
+  mmu_write(cpu, cpu->SP, cpu->DE >> 8); // High
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->DE & 0x00FF; // Low
+  mmu_write(cpu, cpu->SP, cpu->DE & 0x00FF); // Low
 }
 
 void push_hl(CPU *cpu) {
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->HL >> 8; // High
+  mmu_write(cpu, cpu->SP, cpu->HL >> 8); // High
   cpu->SP--;
-  cpu->memory[cpu->SP] = cpu->HL & 0x00FF; // Low
+  mmu_write(cpu, cpu->SP, cpu->HL & 0x00FF); // Low
 }
 
 void ld_hli_a(CPU *cpu) {
   uint8_t a_reg = get_first_reg(cpu->AF);
-  cpu->memory[cpu->HL] = a_reg;
+  mmu_write(cpu, cpu->HL, a_reg);
   cpu->HL++;
 }
 
@@ -333,13 +346,115 @@ void dec_de(CPU *cpu) { cpu->DE--; }
 void dec_sp(CPU *cpu) { cpu->SP--; }
 
 void ret(CPU *cpu) {
-  uint8_t low = cpu->memory[cpu->SP];
+  uint8_t low = mmu_read(cpu, cpu->SP);
   cpu->SP++;
-  uint8_t high = cpu->memory[cpu->SP];
+  uint8_t high = mmu_read(cpu, cpu->SP);
   cpu->SP++;
   cpu->PC = high << 8 | low;
 }
 
+// Base T-cycles per opcode. Conditional branches list the not-taken cost,
+// the handler adds the extra cycles when the branch is taken. 0xCB is
+// accounted for in special_opcode_cycles.
+const uint8_t opcode_cycles[256] = {
+     4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4, // 0x00
+     4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4, // 0x10
+     8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4, // 0x20
+     8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4, // 0x30
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 0x40
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 0x50
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 0x60
+     8,  8,  8,  8,  8,  8,  8,  8,  4,  4,  4,  4,  4,  4,  8,  4, // 0x70
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 0x80
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 0x90
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 0xA0
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4, // 0xB0
+     8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  0, 12, 24,  8, 16, // 0xC0
+     8, 12, 12,  0, 12, 16,  8, 16,  8, 16, 12,  0, 12,  0,  8, 16, // 0xD0
+    12, 12,  8,  0,  0, 16,  8, 16, 16,  4, 16,  0,  0,  0,  8, 16, // 0xE0
+    12, 12,  8,  4,  0, 16,  8, 16, 12,  8, 16,  4,  0,  0,  8, 16, // 0xF0
+};
+
+// Instruction length in bytes including the opcode, 0xCB counts its
+// suffix byte. Used to decode code without executing it.
+const uint8_t opcode_lengths[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1, // 0x00
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x10
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x20
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // 0xC0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1, // 0xD0
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // 0xE0
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // 0xF0
+};
+
+// Control flow class of every opcode, opcodes without an entry fall
+// through to the next instruction
+const uint8_t opcode_flow[256] = {
+    [0x10] = FLOW_BARRIER,
+    [0x18] = FLOW_JUMP,
+    [0x20] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0x28] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0x30] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0x38] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0x76] = FLOW_BARRIER,
+    [0xC0] = FLOW_RETURN | FLOW_CONDITIONAL,
+    [0xC2] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0xC3] = FLOW_JUMP,
+    [0xC4] = FLOW_CALL | FLOW_CONDITIONAL,
+    [0xC7] = FLOW_RESTART,
+    [0xC8] = FLOW_RETURN | FLOW_CONDITIONAL,
+    [0xC9] = FLOW_RETURN,
+    [0xCA] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0xCC] = FLOW_CALL | FLOW_CONDITIONAL,
+    [0xCD] = FLOW_CALL,
+    [0xCF] = FLOW_RESTART,
+    [0xD0] = FLOW_RETURN | FLOW_CONDITIONAL,
+    [0xD2] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0xD4] = FLOW_CALL | FLOW_CONDITIONAL,
+    [0xD7] = FLOW_RESTART,
+    [0xD8] = FLOW_RETURN | FLOW_CONDITIONAL,
+    [0xD9] = FLOW_RETURN,
+    [0xDA] = FLOW_JUMP | FLOW_CONDITIONAL,
+    [0xDC] = FLOW_CALL | FLOW_CONDITIONAL,
+    [0xDF] = FLOW_RESTART,
+    [0xE7] = FLOW_RESTART,
+    [0xE9] = FLOW_INDIRECT,
+    [0xEF] = FLOW_RESTART,
+    [0xF3] = FLOW_BARRIER,
+    [0xF7] = FLOW_RESTART,
+    [0xFB] = FLOW_BARRIER,
+    [0xFF] = FLOW_RESTART,
+};
+
+// T-cycles per CB prefixed opcode, including the prefix fetch
+const uint8_t special_opcode_cycles[256] = {
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0x00
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0x10
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0x20
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0x30
+     8,  8,  8,  8,  8,  8, 12,  8,  8,  8,  8,  8,  8,  8, 12,  8, // 0x40
+     8,  8,  8,  8,  8,  8, 12,  8,  8,  8,  8,  8,  8,  8, 12,  8, // 0x50
+     8,  8,  8,  8,  8,  8, 12,  8,  8,  8,  8,  8,  8,  8, 12,  8, // 0x60
+     8,  8,  8,  8,  8,  8, 12,  8,  8,  8,  8,  8,  8,  8, 12,  8, // 0x70
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0x80
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0x90
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0xA0
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0xB0
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0xC0
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0xD0
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0xE0
+     8,  8,  8,  8,  8,  8, 16,  8,  8,  8,  8,  8,  8,  8, 16,  8, // 0xF0
+};
+
 special_opcode_function special_opcode_table[256] = {
     [0x00] = not_implemented, //
     [0x01] = not_implemented, //
@@ -516,7 +631,7 @@ special_opcode_function special_opcode_table[256] = {
     [0xAC] = not_implemented, //
     [0xAD] = not_implemented, //
     [0xAE] = not_implemented, //
-    [0xAF] = push_af,         //
+    [0xAF] = not_implemented, //
     [0xB0] = not_implemented, //
     [0xB1] = not_implemented, //
     [0xB2] = not_implemented, //
@@ -604,7 +719,7 @@ opcode_function opcode_table[256] = {
     [0x01] = not_implemented, //
     [0x02] = not_implemented, //
     [0x03] = not_implemented, //
-    [0x04] = not_implemented, //
+    [0x04] = inc_b,           //
     [0x05] = dec_b,           //
     [0x06] = ld_b_n8,         //
     [0x07] = not_implemented, //
@@ -620,7 +735,7 @@ opcode_function opcode_table[256] = {
     [0x11] = ld_de_a,         //
     [0x12] = not_implemented, //
     [0x13] = not_implemented, //
-    [0x14] = not_implemented, //
+    [0x14] = inc_d,           //
     [0x15] = not_implemented, //
     [0x16] = not_implemented, //
     [0x17] = rla,             //
@@ -628,7 +743,7 @@ opcode_function opcode_table[256] = {
     [0x19] = not_implemented, //
     [0x1A] = ld_a_de,         //
     [0x1B] = not_implemented, //
-    [0x1C] = not_implemented, //
+    [0x1C] = inc_e,           //
     [0x1D] = not_implemented, //
     [0x1E] = not_implemented, //
     [0x1F] = not_implemented, //
@@ -636,7 +751,7 @@ opcode_function opcode_table[256] = {
     [0x21] = ld_hl_n16,       //
     [0x22] = ld_hli_a,        //
     [0x23] = inc_hl,          //
-    [0x24] = not_implemented, //
+    [0x24] = inc_h,           //
     [0x25] = not_implemented, //
     [0x26] = not_implemented, //
     [0x27] = not_implemented, //
@@ -644,7 +759,7 @@ opcode_function opcode_table[256] = {
     [0x29] = not_implemented, //
     [0x2A] = not_implemented, //
     [0x2B] = not_implemented, //
-    [0x2C] = not_implemented, //
+    [0x2C] = inc_l,           //
     [0x2D] = not_implemented, //
     [0x2E] = not_implemented, //
     [0x2F] = not_implemented, //
@@ -859,7 +974,39 @@ opcode_function opcode_table[256] = {
 };
 
 void initialize_cpu(CPU *cpu, uint8_t *memory) {
+  cpu->BC = 0;
+  cpu->DE = 0;
+  cpu->HL = 0;
+  cpu->AF = 0;
+  cpu->SP = 0;
   cpu->PC = 0;
+  cpu->ime = 0;
+  cpu->cycles = 0;
+  cpu->speed_shift = 0;
+  cpu->fault = 0;
+  cpu->joypad = 0;
+
+  cpu->rom = NULL;
+  cpu->rom_size = 0;
+  cpu->rom_bank = 1;
+  cpu->rom_window = NULL;
+  cpu->cgb = 0;
+  cpu->wram_bank = 1;
+  cpu->wram_banks = NULL;
+  cpu->sram = NULL;
+  cpu->sram_size = 0;
+  cpu->sram_fd = -1;
+  cpu->sram_bank = 0;
+  cpu->sram_enabled = 0;
+  cpu->sram_dirty = 0;
+  cpu->ppu = NULL;
+  cpu->apu = NULL;
+  cpu->serial_out = NULL;
+  cpu->jit = NULL;
+  cpu->aot = NULL;
+  cpu->debugger = NULL;
+  cpu->watch_pages = NULL;
+
   cpu->memory = memory;
   if (cpu->memory == NULL) {
     perror("Failed to allocate memory for the cpu.");
@@ -867,15 +1014,169 @@ void initialize_cpu(CPU *cpu, uint8_t *memory) {
   }
 }
 
+// I/O registers as the boot ROMs leave them, written in order through the
+// MMU so the PPU and APU see them. Sound is powered before its registers,
+// the channel triggers are left out so the boot chime does not replay.
+typedef struct BootRegister {
+  uint16_t address;
+  uint8_t dmg;
+  uint8_t cgb;
+} BootRegister;
+
+static const BootRegister boot_registers[] = {
+    {0xFF00, 0xCF, 0xCF}, // P1
+    {0xFF01, 0x00, 0x00}, // SB
+    {0xFF02, 0x7E, 0x7F}, // SC
+    {0xFF05, 0x00, 0x00}, // TIMA
+    {0xFF06, 0x00, 0x00}, // TMA
+    {0xFF07, 0xF8, 0xF8}, // TAC
+    {0xFF0F, 0xE1, 0xE1}, // IF
+    {0xFF26, 0x80, 0x80}, // NR52
+    {0xFF10, 0x80, 0x80}, // NR10
+    {0xFF11, 0xBF, 0xBF}, // NR11
+    {0xFF12, 0xF3, 0xF3}, // NR12
+    {0xFF13, 0xFF, 0xFF}, // NR13
+    {0xFF14, 0x3F, 0x3F}, // NR14
+    {0xFF16, 0x3F, 0x3F}, // NR21
+    {0xFF17, 0x00, 0x00}, // NR22
+    {0xFF18, 0xFF, 0xFF}, // NR23
+    {0xFF19, 0x3F, 0x3F}, // NR24
+    {0xFF1A, 0x7F, 0x7F}, // NR30
+    {0xFF1B, 0xFF, 0xFF}, // NR31
+    {0xFF1C, 0x9F, 0x9F}, // NR32
+    {0xFF1D, 0xFF, 0xFF}, // NR33
+    {0xFF1E, 0x3F, 0x3F}, // NR34
+    {0xFF20, 0xFF, 0xFF}, // NR41
+    {0xFF21, 0x00, 0x00}, // NR42
+    {0xFF22, 0x00, 0x00}, // NR43
+    {0xFF23, 0x3F, 0x3F}, // NR44
+    {0xFF24, 0x77, 0x77}, // NR50
+    {0xFF25, 0xF3, 0xF3}, // NR51
+    {0xFF42, 0x00, 0x00}, // SCY
+    {0xFF43, 0x00, 0x00}, // SCX
+    {0xFF45, 0x00, 0x00}, // LYC
+    {0xFF47, 0xFC, 0xFC}, // BGP
+    {0xFF48, 0xFF, 0xFF}, // OBP0
+    {0xFF49, 0xFF, 0xFF}, // OBP1
+    {0xFF4A, 0x00, 0x00}, // WY
+    {0xFF4B, 0x00, 0x00}, // WX
+    {0xFF40, 0x91, 0x91}, // LCDC, last so the PPU starts on a full frame
+    {0xFFFF, 0x00, 0x00}, // IE
+};
+
+// Registered trademark tile the boot ROM places after the logo
+static const uint8_t boot_trademark[8] = {0x3C, 0x42, 0xB9, 0xA5,
+                                          0xB9, 0xA5, 0x42, 0x3C};
+
+// Each logo nibble becomes a row of doubled pixels, drawn twice
+static uint8_t double_pixels(uint8_t nibble) {
+  uint8_t row = 0;
+  for (int bit = 3; bit >= 0; bit--)
+    row = (row << 2) | ((nibble >> bit) & 1 ? 0x03 : 0x00);
+  return row;
+}
+
+// Decode the cartridge header logo into tiles 1 - 24, the trademark into
+// tile 25 and lay them out on the background map
+static void draw_boot_logo(CPU *cpu) {
+  uint8_t *tiles = cpu->memory + 0x8010;
+  for (int i = 0; i < 48; i++) {
+    uint8_t value = cpu->memory[0x104 + i];
+    uint8_t rows[2] = {double_pixels(value >> 4), double_pixels(value & 0x0F)};
+    for (int j = 0; j < 2; j++) {
+      tiles[i * 8 + j * 4] = rows[j];
+      tiles[i * 8 + j * 4 + 2] = rows[j];
+    }
+  }
+  for (int i = 0; i < 8; i++)
+    cpu->memory[0x8190 + i * 2] = boot_trademark[i];
+
+  for (int i = 0; i < 12; i++) {
+    cpu->memory[0x9904 + i] = i + 1;
+    cpu->memory[0x9924 + i] = i + 13;
+  }
+  cpu->memory[0x9910] = 0x19;
+}
+
+// Machine state left behind by the DMG or CGB boot ROM, for starting at the
+// cartridge entry point without running it. Expects the cartridge loaded.
+void post_boot_state(CPU *cpu) {
+  if (cpu->cgb) {
+    cpu->AF = 0x1180;
+    cpu->BC = 0x0000;
+    cpu->DE = 0xFF56;
+    cpu->HL = 0x000D;
+  } else {
+    // H and C are left set when the header checksum is not zero
+    cpu->AF = 0x0180 | (cpu->memory[0x14D] != 0 ? 0x30 : 0x00);
+    cpu->BC = 0x0013;
+    cpu->DE = 0x00D8;
+    cpu->HL = 0x014D;
+  }
+  cpu->SP = 0xFFFE;
+  cpu->PC = 0x0100;
+
+  draw_boot_logo(cpu);
+  for (size_t i = 0; i < sizeof(boot_registers) / sizeof(*boot_registers); i++) {
+    const BootRegister *reg = &boot_registers[i];
+    mmu_write(cpu, reg->address, cpu->cgb ? reg->cgb : reg->dmg);
+  }
+  // Written directly, through the MMU it would start a transfer
+  cpu->memory[0xFF46] = cpu->cgb ? 0x00 : 0xFF;
+  mmu_write(cpu, 0xFF50, 0x01);
+}
+
 void step(CPU *cpu) {
   uint8_t instruction = fetch_byte(cpu);
+#ifdef TRACE_EXECUTION
   printf("Executing -> %02x\n", instruction);
+#endif
+  cpu->cycles += opcode_cycles[instruction] >> cpu->speed_shift;
   opcode_table[instruction](cpu);
 }
 
+// Without a PPU or with the LCD off a frame is CYCLES_PER_FRAME long
+uint64_t frame_end(CPU *cpu) {
+  if (cpu->ppu == NULL)
+    return cpu->cycles + CYCLES_PER_FRAME;
+  return ppu_frame_end(cpu->ppu, cpu->cycles);
+}
+
+// Step until the end of the frame, then bring the PPU up to date and hand
+// the frame's audio over
+void run_frame(CPU *cpu) {
+  uint64_t end = frame_end(cpu);
+  if (cpu->aot != NULL)
+    while (cpu->cycles < end && !cpu->fault)
+      aot_step(cpu);
+  else if (cpu->jit != NULL)
+    while (cpu->cycles < end && !cpu->fault)
+      jit_step(cpu);
+  else
+    while (cpu->cycles < end && !cpu->fault)
+      step(cpu);
+
+  end_frame(cpu);
+}
+
+// Bring the PPU and APU up to the end of the frame
+void end_frame(CPU *cpu) {
+  if (cpu->ppu != NULL)
+    ppu_run_to(cpu->ppu, cpu->cycles);
+  if (cpu->apu != NULL)
+    apu_end_frame(cpu->apu, cpu->cycles);
+}
+
 void prefix(CPU *cpu) {
   uint8_t instruction = fetch_byte(cpu);
+#ifdef TRACE_EXECUTION
   printf("Executing(S) -> %02x\n", instruction);
+#endif
+  cpu->cycles += special_opcode_cycles[instruction] >> cpu->speed_shift;
   special_opcode_table[instruction](cpu);
 }
-void destroy_cpu(CPU *cpu) { free(cpu->memory); }
+void destroy_cpu(CPU *cpu) {
+  free(cpu->memory);
+  free(cpu->rom);
+  free(cpu->wram_banks);
+}
@@ -1,11 +1,30 @@
 #ifndef CPU_NEOSAHADEO
 #define CPU_NEOSAHADEO
 
+#include "apu.h"
+#include "ppu.h"
 #include <inttypes.h>
+#include <stddef.h>
+
+#define CPU_CLOCK_HZ 4194304
+#define CYCLES_PER_FRAME 70224 // 154 lines of 456 cycles
+
+#define WRAM_BANK_SIZE 0x1000
+#define WRAM_BANKS 8 // CGB, banks 0 and 1 always live in the memory map
+
+// Bits of CPU.joypad, set while the button is held
+#define JOYPAD_RIGHT 0x01
+#define JOYPAD_LEFT 0x02
+#define JOYPAD_UP 0x04
+#define JOYPAD_DOWN 0x08
+#define JOYPAD_A 0x10
+#define JOYPAD_B 0x20
+#define JOYPAD_SELECT 0x40
+#define JOYPAD_START 0x80
+
 typedef struct CPU {
   // General Memory
   uint8_t *memory;
-  uint8_t *vram;
 
   // Registers
   uint16_t BC;
@@ -17,10 +36,90 @@ typedef struct CPU {
   uint16_t SP; // Stack pointer
   uint16_t PC; // Program counter
 
+  uint8_t ime; // Interrupt master enable
+
+  // Cycles are counted at the 4 MiHz system clock the PPU and APU run on.
+  // In double speed instructions take half as many of them.
+  uint64_t cycles;
+  uint8_t speed_shift; // 1 in double speed, CGB only
+  // Set by an opcode without a handler, PC is just past it. Frames stop
+  // there instead of running whatever follows.
+  uint8_t fault;
+
+  // Cartridge ROM, bank 0 is mirrored into memory. The selected bank is
+  // read in place, switching banks only moves rom_window.
+  uint8_t *rom;
+  size_t rom_size;
+  uint16_t rom_bank;
+  const uint8_t *rom_window; // NULL leaves 0x4000 - 0x7FFF to memory
+
+  // Battery backed cartridge RAM, mapped straight from the save file. NULL
+  // leaves 0xA000 - 0xBFFF to the flat memory map.
+  uint8_t *sram;
+  size_t sram_size;
+  int sram_fd; // Locked save file, or -1 when the RAM is not file backed
+  uint8_t sram_bank;
+  uint8_t sram_enabled;
+  uint8_t sram_dirty; // Written since the last flush
+
+  uint8_t joypad; // Buttons held, set by the host before each frame
+
+  // Game Boy Color cartridge, set from the header by load_cartridge
+  uint8_t cgb;
+  // WRAM bank mapped at 0xD000. Bank 1 lives in the memory map, banks 2 -
+  // 7 in wram_banks, indexed by bank number. The banks are only there for
+  // CGB cartridges, and kept out of the CPU so copies of it stay small.
+  // load_cartridge allocates them unless the host already did.
+  uint8_t wram_bank;
+  uint8_t (*wram_banks)[WRAM_BANK_SIZE];
+
+  PPU *ppu; // NULL when running without video
+  APU *apu; // NULL when running without sound
+
+  // Called with every byte shifted out of the serial port
+  void (*serial_out)(struct CPU *cpu, uint8_t value);
+
+  struct JIT *jit; // NULL when only the interpreter runs
+  struct AOT *aot; // Ahead of time translated blocks, NULL when not used
+
+  struct Debugger *debugger; // NULL when not debugging
+  // WATCH_* bits per 256 byte page, NULL while no watchpoint is set
+  const uint8_t *watch_pages;
+
 } CPU;
 
+// Decode information for walking code without executing it
+enum {
+  FLOW_NONE,     // Falls through to the next instruction
+  FLOW_JUMP,     // JR or JP to an immediate target
+  FLOW_CALL,     // CALL to an immediate target, returns to the next one
+  FLOW_RESTART,  // RST to a fixed vector, returns to the next one
+  FLOW_RETURN,   // RET and RETI, the target is on the stack
+  FLOW_INDIRECT, // JP HL
+  FLOW_BARRIER,  // HALT, STOP, DI and EI continue at the next instruction
+};
+#define FLOW_CONDITIONAL 0x80
+#define FLOW_KIND(flow) ((flow) & ~FLOW_CONDITIONAL)
+
+typedef void (*opcode_function)(CPU *cpu);
+typedef void (*special_opcode_function)(CPU *cpu);
+
+extern opcode_function opcode_table[256];
+extern special_opcode_function special_opcode_table[256];
+extern const uint8_t opcode_cycles[256];
+extern const uint8_t special_opcode_cycles[256];
+extern const uint8_t opcode_lengths[256];
+extern const uint8_t opcode_flow[256];
+
 void initialize_cpu(CPU *cpu, uint8_t *memory);
+void post_boot_state(CPU *cpu);
 void step(CPU *cpu);
+// Frames end when the PPU enters V-blank, so the one just composed is whole
+uint64_t frame_end(CPU *cpu);
+void run_frame(CPU *cpu);
+void end_frame(CPU *cpu);
+void prefix(CPU *cpu);
+void not_implemented(CPU *cpu);
 void destroy_cpu(CPU *cpu);
 
 #endif
@@ -0,0 +1,94 @@
+#include "cpu.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Checks handlers that have been wrong before, without any ROM: each case
+// is a few assembled bytes in work RAM stepped through the interpreter,
+// then registers, PC and cycles are compared with what the hardware does.
+
+#define CODE 0xC000
+#define MAX_CODE 8
+
+#define FLAG_Z 0x80
+#define FLAG_N 0x40
+#define FLAG_H 0x20
+#define FLAG_C 0x10
+
+typedef struct Case {
+  const char *name;
+  uint8_t code[MAX_CODE];
+  uint16_t AF;
+  uint16_t BC;
+  int steps;
+
+  uint16_t expected_AF;
+  uint16_t expected_BC;
+  uint16_t expected_PC;
+  uint64_t expected_cycles;
+} Case;
+
+static const Case cases[] = {
+    // The displacement is consumed whether or not the branch is taken
+    {"jr nz taken", {0x20, 0x05}, 0x0000, 0x0000, 1,
+     0x0000, 0x0000, CODE + 7, 12},
+    {"jr nz not taken", {0x20, 0x05}, FLAG_Z, 0x0000, 1,
+     FLAG_Z, 0x0000, CODE + 2, 8},
+    {"jr nz backwards", {0x00, 0x20, 0xFD}, 0x0000, 0x0000, 2,
+     0x0000, 0x0000, CODE, 16},
+    // Only B changes, C and the carry are left alone
+    {"inc b", {0x04}, FLAG_N | FLAG_C, 0x0F34, 1,
+     FLAG_H | FLAG_C, 0x1034, CODE + 1, 4},
+    {"inc b wraps", {0x04}, 0x0000, 0xFF34, 1,
+     FLAG_Z | FLAG_H, 0x0034, CODE + 1, 4},
+    // ld b, 0xFE / loop: inc b / jr nz, loop
+    {"inc b loop", {0x06, 0xFE, 0x04, 0x20, 0xFD}, 0x0000, 0x0000, 5,
+     FLAG_Z | FLAG_H, 0x0000, CODE + 5, 36},
+};
+
+static int run_case(const Case *c, uint8_t *memory) {
+  CPU cpu;
+  memset(memory, 0, 0x10000);
+  initialize_cpu(&cpu, memory);
+  memcpy(memory + CODE, c->code, MAX_CODE);
+  cpu.AF = c->AF;
+  cpu.BC = c->BC;
+  cpu.PC = CODE;
+
+  for (int i = 0; i < c->steps && !cpu.fault; i++)
+    step(&cpu);
+
+  if (!cpu.fault && cpu.AF == c->expected_AF && cpu.BC == c->expected_BC &&
+      cpu.PC == c->expected_PC && cpu.cycles == c->expected_cycles)
+    return 1;
+
+  fprintf(stderr, "FAIL     cpu %s\n", c->name);
+  fprintf(stderr,
+          "  %-8s AF=%04X BC=%04X PC=%04X cycles=%" PRIu64 " fault=%u\n",
+          "got", cpu.AF, cpu.BC, cpu.PC, cpu.cycles, cpu.fault);
+  fprintf(stderr, "  %-8s AF=%04X BC=%04X PC=%04X cycles=%" PRIu64 "\n",
+          "expected", c->expected_AF, c->expected_BC, c->expected_PC,
+          c->expected_cycles);
+  return 0;
+}
+
+int main(void) {
+  uint8_t *memory = calloc(0x10000, 1);
+  if (memory == NULL) {
+    perror("Failed to allocate memory.");
+    return EXIT_FAILURE;
+  }
+
+  int count = sizeof(cases) / sizeof(cases[0]);
+  int passed = 0;
+  for (int i = 0; i < count; i++)
+    passed += run_case(&cases[i], memory);
+  free(memory);
+
+  if (passed != count)
+    return EXIT_FAILURE;
+  printf("PASS     cpu handlers, %d cases\n", count);
+  return EXIT_SUCCESS;
+}
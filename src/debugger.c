@@ -0,0 +1,270 @@
+#include "debugger.h"
+#include "aot.h"
+#include "jit.h"
+#include "mmu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLAG_Z 0x80
+#define FLAG_N 0x40
+#define FLAG_H 0x20
+#define FLAG_C 0x10
+
+Debugger *debugger_attach(CPU *cpu) {
+  Debugger *debugger = calloc(1, sizeof(Debugger));
+  if (debugger == NULL) {
+    perror("Failed to allocate the debugger.");
+    return NULL;
+  }
+  cpu->debugger = debugger;
+  return debugger;
+}
+
+void debugger_detach(CPU *cpu) {
+  if (cpu->debugger == NULL)
+    return;
+
+  // Blocks compiled around the breakpoints can grow back over them
+  if (cpu->jit != NULL && cpu->debugger->breakpoint_count > 0)
+    jit_invalidate(cpu->jit, 0x0000, 0x10000);
+  free(cpu->debugger);
+  cpu->debugger = NULL;
+  cpu->watch_pages = NULL;
+}
+
+void debugger_set_breakpoint(CPU *cpu, uint16_t address, int enabled) {
+  Debugger *debugger = cpu->debugger;
+  uint8_t bit = 1 << (address & 7);
+  if (!debugger_breakpoint(debugger, address) == !enabled)
+    return;
+
+  if (enabled) {
+    debugger->breakpoints[address >> 3] |= bit;
+    debugger->breakpoint_count++;
+  } else {
+    debugger->breakpoints[address >> 3] &= ~bit;
+    debugger->breakpoint_count--;
+  }
+
+  // Recompile whatever block runs through the address
+  if (cpu->jit != NULL)
+    jit_invalidate(cpu->jit, address, address + 1);
+}
+
+void debugger_set_watchpoint(CPU *cpu, uint16_t address, uint8_t access) {
+  Debugger *debugger = cpu->debugger;
+  access &= WATCH_READ | WATCH_WRITE;
+  if (!debugger->watchpoints[address] != !access)
+    debugger->watchpoint_count += access ? 1 : -1;
+  debugger->watchpoints[address] = access;
+
+  uint8_t page = address >> 8;
+  uint8_t bits = 0;
+  for (uint32_t i = page << 8; i < (uint32_t)(page + 1) << 8; i++)
+    bits |= debugger->watchpoints[i];
+  debugger->watch_pages[page] = bits;
+
+  cpu->watch_pages = debugger->watchpoint_count > 0 ? debugger->watch_pages
+                                                    : NULL;
+}
+
+void debugger_access(CPU *cpu, uint16_t address, uint8_t value,
+                     uint8_t access) {
+  Debugger *debugger = cpu->debugger;
+  if (!debugger->running || !(debugger->watchpoints[address] & access))
+    return;
+
+  // The first access of a block is the one reported
+  if (debugger->stop != DEBUG_RUNNING)
+    return;
+  debugger->stop = DEBUG_WATCHPOINT;
+  debugger->stop_address = address;
+  debugger->stop_access = access;
+  debugger->stop_value = access == WATCH_WRITE ? value : 0;
+}
+
+DebugStop debugger_step(CPU *cpu) {
+  Debugger *debugger = cpu->debugger;
+  debugger->stop = DEBUG_RUNNING;
+  debugger->running = 1;
+  // Resuming from a fault skips the instruction that had no handler
+  cpu->fault = 0;
+  step(cpu);
+  if (cpu->fault)
+    debugger->stop = DEBUG_FAULT;
+  debugger->running = 0;
+  debugger->resuming = 1;
+  return debugger->stop;
+}
+
+DebugStop debugger_run_frame(CPU *cpu) {
+  Debugger *debugger = cpu->debugger;
+  uint64_t end = frame_end(cpu);
+  int translated = cpu->aot != NULL && debugger->breakpoint_count == 0;
+
+  debugger->stop = DEBUG_RUNNING;
+  debugger->running = 1;
+  cpu->fault = 0;
+  while (cpu->cycles < end) {
+    if (debugger->pause) {
+      debugger->pause = 0;
+      debugger->stop = DEBUG_PAUSED;
+      break;
+    }
+    if (!debugger->resuming && debugger_breakpoint(debugger, cpu->PC)) {
+      debugger->stop = DEBUG_BREAKPOINT;
+      break;
+    }
+    debugger->resuming = 0;
+
+    if (translated)
+      aot_step(cpu);
+    else if (cpu->jit != NULL)
+      jit_step(cpu);
+    else
+      step(cpu);
+    if (cpu->fault)
+      debugger->stop = DEBUG_FAULT;
+    if (debugger->stop != DEBUG_RUNNING)
+      break;
+  }
+  debugger->running = 0;
+
+  if (debugger->stop != DEBUG_RUNNING) {
+    debugger->resuming = 1;
+    return debugger->stop;
+  }
+  end_frame(cpu);
+  return DEBUG_RUNNING;
+}
+
+void debugger_print_registers(const CPU *cpu, FILE *out) {
+  uint8_t f = cpu->AF & 0xFF;
+  fprintf(out,
+          "AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X %c%c%c%c IME=%d "
+          "cycles=%" PRIu64 "\n",
+          cpu->AF, cpu->BC, cpu->DE, cpu->HL, cpu->SP, cpu->PC,
+          f & FLAG_Z ? 'Z' : '-', f & FLAG_N ? 'N' : '-',
+          f & FLAG_H ? 'H' : '-', f & FLAG_C ? 'C' : '-', cpu->ime,
+          cpu->cycles);
+}
+
+void debugger_print_memory(CPU *cpu, FILE *out, uint16_t address,
+                           size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    uint16_t current = address + i;
+    if (i % 16 == 0)
+      fprintf(out, "%s%04X:", i > 0 ? "\n" : "", current);
+    fprintf(out, " %02X", mmu_read(cpu, current));
+  }
+  fprintf(out, "\n");
+}
+
+static void print_stop(CPU *cpu, FILE *out) {
+  Debugger *debugger = cpu->debugger;
+  switch (debugger->stop) {
+  case DEBUG_PAUSED:
+    fprintf(out, "Paused\n");
+    break;
+  case DEBUG_BREAKPOINT:
+    fprintf(out, "Breakpoint at %04X\n", cpu->PC);
+    break;
+  case DEBUG_WATCHPOINT:
+    if (debugger->stop_access == WATCH_WRITE)
+      fprintf(out, "Write of %02X to %04X\n", debugger->stop_value,
+              debugger->stop_address);
+    else
+      fprintf(out, "Read of %04X\n", debugger->stop_address);
+    break;
+  case DEBUG_FAULT:
+    fprintf(out, "Instruction not implemented: %02x\n",
+            mmu_read(cpu, cpu->PC - 1));
+    break;
+  case DEBUG_RUNNING:
+    break;
+  }
+  debugger_print_registers(cpu, out);
+}
+
+static void print_help(FILE *out) {
+  fprintf(out, "s                step one instruction\n"
+               "c                continue\n"
+               "b ADDR           set a breakpoint\n"
+               "d ADDR           delete a breakpoint\n"
+               "w ADDR [r|w|rw]  watch accesses, writes when omitted\n"
+               "u ADDR           remove a watchpoint\n"
+               "r                print the registers\n"
+               "x ADDR [COUNT]   print memory\n");
+}
+
+void debugger_prompt(CPU *cpu, FILE *in, FILE *out) {
+  char line[128];
+  print_stop(cpu, out);
+
+  for (;;) {
+    fprintf(out, "(debug) ");
+    fflush(out);
+    if (fgets(line, sizeof(line), in) == NULL) {
+      debugger_detach(cpu);
+      return;
+    }
+
+    char command = 0;
+    unsigned int address = 0;
+    char argument[8] = "";
+    int fields = sscanf(line, " %c %x %7s", &command, &address, argument);
+    if (fields < 1)
+      continue;
+    address &= 0xFFFF;
+
+    int valid = 1;
+    switch (command) {
+    case 's':
+      debugger_step(cpu);
+      print_stop(cpu, out);
+      break;
+    case 'c':
+      return;
+    case 'b':
+    case 'd':
+      valid = fields >= 2;
+      if (valid)
+        debugger_set_breakpoint(cpu, address, command == 'b');
+      break;
+    case 'w': {
+      uint8_t access = WATCH_WRITE;
+      if (fields == 3) {
+        access = 0;
+        if (strchr(argument, 'r') != NULL)
+          access |= WATCH_READ;
+        if (strchr(argument, 'w') != NULL)
+          access |= WATCH_WRITE;
+      }
+      valid = fields >= 2 && access != 0;
+      if (valid)
+        debugger_set_watchpoint(cpu, address, access);
+      break;
+    }
+    case 'u':
+      valid = fields >= 2;
+      if (valid)
+        debugger_set_watchpoint(cpu, address, 0);
+      break;
+    case 'r':
+      debugger_print_registers(cpu, out);
+      break;
+    case 'x':
+      valid = fields >= 2;
+      if (valid)
+        debugger_print_memory(cpu, out, address,
+                              fields == 3 ? strtoul(argument, NULL, 0) : 16);
+      break;
+    default:
+      valid = 0;
+      break;
+    }
+    if (!valid)
+      print_help(out);
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef DEBUGGER_NEOSAHADEO
+#define DEBUGGER_NEOSAHADEO
+
+#include "cpu.h"
+#include <inttypes.h>
+#include <stdio.h>
+
+// Access bits of a watchpoint
+#define WATCH_READ 0x01
+#define WATCH_WRITE 0x02
+
+typedef enum {
+  DEBUG_RUNNING,    // The frame ran to its end
+  DEBUG_PAUSED,     // Stopped on request before the next instruction
+  DEBUG_BREAKPOINT, // PC reached a breakpoint, the instruction has not run
+  DEBUG_WATCHPOINT, // A watched address was accessed by the last block
+  DEBUG_FAULT,      // The last instruction has no handler, see CPU.fault
+} DebugStop;
+
+// Breakpoints are checked between blocks, the JIT ends its blocks in front
+// of them and translated AOT blocks are left for the interpreter while any
+// are set. Watched memory is only seen by the bus through
+// CPU.watch_pages, which stays NULL while nothing is watched, so a
+// debugger without watchpoints costs the bus nothing.
+typedef struct Debugger {
+  uint8_t breakpoints[0x10000 / 8]; // One bit per address
+  size_t breakpoint_count;
+
+  uint8_t watchpoints[0x10000]; // WATCH_* bits per address
+  uint8_t watch_pages[256];     // Union of the bits in each 256 byte page
+  size_t watchpoint_count;
+
+  int pause;    // Stop before the next instruction
+  int resuming; // Run the instruction at PC even when it has a breakpoint
+  int running;  // Accesses only stop execution, not inspection
+
+  DebugStop stop;
+  uint16_t stop_address; // Watched address that was accessed
+  uint8_t stop_access;   // WATCH_READ or WATCH_WRITE
+  uint8_t stop_value;    // Value written, 0 for reads
+} Debugger;
+
+static inline int debugger_breakpoint(const Debugger *debugger,
+                                      uint16_t address) {
+  return debugger->breakpoints[address >> 3] & (1 << (address & 7));
+}
+
+// NULL when the debugger can't be allocated
+Debugger *debugger_attach(CPU *cpu);
+void debugger_detach(CPU *cpu);
+
+void debugger_set_breakpoint(CPU *cpu, uint16_t address, int enabled);
+// An access of 0 removes the watchpoint
+void debugger_set_watchpoint(CPU *cpu, uint16_t address, uint8_t access);
+
+// Slow path of the bus for addresses in watched pages
+void debugger_access(CPU *cpu, uint16_t address, uint8_t value, uint8_t access);
+
+// Run one instruction through the interpreter
+DebugStop debugger_step(CPU *cpu);
+
+// Same as run_frame but stops on breakpoints, watchpoints and pauses.
+// Calling it again after a stop continues the same frame.
+DebugStop debugger_run_frame(CPU *cpu);
+
+void debugger_print_registers(const CPU *cpu, FILE *out);
+void debugger_print_memory(CPU *cpu, FILE *out, uint16_t address, size_t size);
+
+// Read commands until execution should continue, the debugger is detached
+// when the input ends
+void debugger_prompt(CPU *cpu, FILE *in, FILE *out);
+
+#endif
@@ -0,0 +1,146 @@
+#include "export.h"
+#include "apu.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+Exporter *export_create(const char *name, const ExportRegion *regions,
+                        size_t region_count) {
+  size_t ram = 0;
+  int outside = 0;
+  for (size_t i = 0; i < region_count; i++) {
+    ram += regions[i].size;
+    outside |= regions[i].start + regions[i].size > 0x10000;
+  }
+  if (region_count > EXPORT_MAX_REGIONS || ram > EXPORT_RAM_SIZE || outside) {
+    fprintf(stderr, "The exported regions do not fit.\n");
+    return NULL;
+  }
+
+  Exporter *exporter = calloc(1, sizeof(Exporter));
+  if (exporter == NULL)
+    return NULL;
+  exporter->name = strdup(name);
+  if (exporter->name == NULL) {
+    free(exporter);
+    return NULL;
+  }
+
+  // A ring of the same name may belong to an emulator still running
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0) {
+    perror("Failed to create the export shared memory.");
+    free(exporter->name);
+    free(exporter);
+    return NULL;
+  }
+  if (ftruncate(fd, sizeof(ExportHeader)) != 0) {
+    perror("Failed to size the export shared memory.");
+    close(fd);
+    shm_unlink(name);
+    free(exporter->name);
+    free(exporter);
+    return NULL;
+  }
+  ExportHeader *header = mmap(NULL, sizeof(ExportHeader),
+                              PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    perror("Failed to map the export shared memory.");
+    shm_unlink(name);
+    free(exporter->name);
+    free(exporter);
+    return NULL;
+  }
+
+  // Readers check the magic last, after the layout is in place
+  memset(header, 0, sizeof(ExportHeader));
+  header->version = EXPORT_VERSION;
+  header->slot_count = EXPORT_SLOTS;
+  header->slot_size = sizeof(ExportSlot);
+  header->region_count = region_count;
+  memcpy(header->regions, regions, region_count * sizeof(ExportRegion));
+  atomic_thread_fence(memory_order_release);
+  header->magic = EXPORT_MAGIC;
+
+  exporter->header = header;
+  return exporter;
+}
+
+void export_destroy(Exporter *exporter) {
+  if (exporter == NULL)
+    return;
+  munmap(exporter->header, sizeof(ExportHeader));
+  shm_unlink(exporter->name);
+  free(exporter->name);
+  free(exporter);
+}
+
+// Samples the APU pushed since the last publish. They stay in the ring
+// after the audio device consumed them, and nothing but the emulator
+// thread writes there, so they are read without taking them.
+static uint32_t copy_audio(Exporter *exporter, APU *apu, int16_t *out) {
+  const AudioRing *ring = &apu->buffers->ring;
+  size_t write = atomic_load_explicit(&ring->write, memory_order_relaxed);
+  size_t start = exporter->audio_write;
+  if (write - start > EXPORT_AUDIO_FRAMES)
+    start = write - EXPORT_AUDIO_FRAMES;
+  exporter->audio_write = write;
+
+  uint32_t frames = 0;
+  for (size_t i = start; i != write; i++, frames++) {
+    size_t slot = (i & (AUDIO_RING_FRAMES - 1)) * 2;
+    out[frames * 2] = ring->samples[slot];
+    out[frames * 2 + 1] = ring->samples[slot + 1];
+  }
+  return frames;
+}
+
+// RAM as the CPU sees it, with the selected CGB WRAM bank at 0xD000
+static void copy_ram(const CPU *cpu, uint8_t *out, uint32_t start,
+                     uint32_t size) {
+  memcpy(out, cpu->memory + start, size);
+  if (cpu->wram_bank < 2)
+    return;
+  uint32_t first = start > 0xD000 ? start : 0xD000;
+  uint32_t end = start + size < 0xE000 ? start + size : 0xE000;
+  if (first < end)
+    memcpy(out + (first - start),
+           cpu->wram_banks[cpu->wram_bank] + (first - 0xD000), end - first);
+}
+
+void export_publish(Exporter *exporter, const CPU *shown, CPU *heard) {
+  ExportHeader *header = exporter->header;
+  uint64_t published =
+      atomic_load_explicit(&header->published, memory_order_relaxed);
+  ExportSlot *slot = &header->slots[published % EXPORT_SLOTS];
+
+  uint32_t sequence =
+      atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+  atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  slot->frame = shown->cycles / CYCLES_PER_FRAME;
+  slot->cycles = shown->cycles;
+  memcpy(slot->framebuffer, shown->ppu->framebuffer,
+         sizeof(slot->framebuffer));
+  slot->audio_cycles = heard->cycles;
+  slot->audio_frames =
+      heard->apu != NULL && heard->apu->buffers != NULL
+          ? copy_audio(exporter, heard->apu, slot->audio)
+          : 0;
+
+  uint8_t *ram = slot->ram;
+  for (uint32_t i = 0; i < header->region_count; i++) {
+    const ExportRegion *region = &header->regions[i];
+    copy_ram(shown, ram, region->start, region->size);
+    ram += region->size;
+  }
+
+  atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+  atomic_store_explicit(&header->published, published + 1,
+                        memory_order_release);
+}
@@ -0,0 +1,74 @@
+#ifndef EXPORT_NEOSAHADEO
+#define EXPORT_NEOSAHADEO
+
+#include "cpu.h"
+#include "ppu.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Every presented frame is published into a POSIX shared memory object
+// for other processes on the same machine to read in place. The emulator
+// never waits for them: slots are protected by seqlocks and a reader that
+// loses the race to the writer retries or picks a newer slot.
+//
+// Reading a slot:
+//   seq = slot->sequence (acquire), odd means it is being written
+//   copy what is needed
+//   acquire fence, the copy is valid when slot->sequence still equals seq
+
+#define EXPORT_MAGIC 0x47424558 // "GBEX"
+#define EXPORT_VERSION 2
+#define EXPORT_SLOTS 4
+#define EXPORT_MAX_REGIONS 8
+#define EXPORT_RAM_SIZE 0x4000     // Regions are packed back to back
+#define EXPORT_AUDIO_FRAMES 4096   // Stereo frames, the rest is dropped
+
+typedef struct ExportRegion {
+  uint16_t start;
+  uint16_t size;
+} ExportRegion;
+
+// The frame, its position and the RAM all come from the machine shown.
+// With run-ahead that is the context running ahead, while the sound is
+// the main context's, which is behind by the run-ahead frames.
+// audio_cycles is where that sound ends.
+typedef struct ExportSlot {
+  _Atomic uint32_t sequence; // Odd while the slot is being written
+  uint32_t audio_frames;
+  uint64_t frame;  // Emulated frames since reset
+  uint64_t cycles;
+  uint64_t audio_cycles;
+  uint32_t framebuffer[LCD_WIDTH * LCD_HEIGHT]; // 0xRRGGBBAA
+  int16_t audio[EXPORT_AUDIO_FRAMES * 2]; // Produced since the last slot
+  uint8_t ram[EXPORT_RAM_SIZE];
+} ExportSlot;
+
+typedef struct ExportHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint32_t region_count;
+  ExportRegion regions[EXPORT_MAX_REGIONS];
+  // Slots published so far, the newest is (published - 1) % slot_count
+  _Atomic uint64_t published;
+  ExportSlot slots[EXPORT_SLOTS];
+} ExportHeader;
+
+typedef struct Exporter {
+  ExportHeader *header;
+  char *name;
+  size_t audio_write; // Ring position exported up to
+} Exporter;
+
+// NULL when the shared memory object can't be created, already exists or
+// the regions do not fit. The object is removed again by export_destroy.
+Exporter *export_create(const char *name, const ExportRegion *regions,
+                        size_t region_count);
+void export_destroy(Exporter *exporter);
+
+// Publish the frame of the machine shown, with the sound heard produced
+void export_publish(Exporter *exporter, const CPU *shown, CPU *heard);
+
+#endif
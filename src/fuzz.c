@@ -0,0 +1,528 @@
+#include "cpu.h"
+#include "jit.h"
+#include "mmu.h"
+#include "utils.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Differential fuzzer for the execution engines. Every engine runs the same
+// random instruction stream from the same random machine state and is
+// compared with the interpreter: registers, flags, cycles, banking state,
+// faults and the whole memory map.
+//
+// Each case runs twice. Stepping, instructions are written at the PC just
+// before they run, so the stream keeps going wherever a jump lands inside
+// work RAM and ends when it leaves, and the JIT compiles every instruction
+// as its own block to be compared after each one. In blocks, the program
+// is laid out from the first PC up front and the JIT runs whole blocks, so
+// values kept in host registers, cycles added at exits, branches and stores
+// into the running block are covered. The interpreter is then stepped to
+// where the block ended and compared there.
+//
+// The first divergence is shrunk to a minimal program and state, and
+// printed with the seed and trial that reproduce it.
+//
+// AOT blocks are translated offline from a fixed ROM, so they can not run
+// random streams and are not fuzzed here.
+
+#define CODE_START 0xC000
+#define CODE_END 0xDE00 // Stay clear of echo RAM and the I/O registers
+#define MAX_LENGTH 256
+#define TABLE_ENTRIES 512 // Base opcodes, then the 0xCB prefixed ones
+#define FUZZ_ROM_SIZE (4 * ROM_BANK_SIZE)
+#define REPORTED_BYTES 64
+
+typedef enum {
+  ENGINE_INTERPRETER, // Reference every other engine is compared with
+  ENGINE_JIT,         // An instruction per block
+  ENGINE_JIT_BLOCKS,
+  ENGINE_COUNT,
+} Engine;
+
+static const char *engine_names[] = {"interpreter", "jit", "jit blocks"};
+
+typedef enum {
+  MODE_STEP,
+  MODE_BLOCK,
+} Mode;
+
+typedef struct Lane {
+  Engine engine;
+  JIT *jit;
+  CPU cpu;
+  uint8_t memory[0x10000];
+  uint8_t wram_banks[WRAM_BANKS][WRAM_BANK_SIZE];
+} Lane;
+
+// Lanes run the same way, the first is the interpreter
+typedef struct Group {
+  Mode mode;
+  Lane *lanes[ENGINE_COUNT];
+  int lane_count;
+} Group;
+
+typedef struct Instruction {
+  uint8_t bytes[3]; // Unused operand bytes are random too
+} Instruction;
+
+// Machine state below 0x8000 is the cartridge, made from the seed
+typedef struct Case {
+  uint16_t AF;
+  uint16_t BC;
+  uint16_t DE;
+  uint16_t HL;
+  uint16_t SP;
+  uint16_t PC;
+  uint8_t ime;
+  uint8_t speed_shift;
+  uint8_t high_memory[0x8000];
+
+  Instruction program[MAX_LENGTH];
+  int length;
+} Case;
+
+typedef struct Divergence {
+  // Instruction, or block in MODE_BLOCK, after which the engines
+  // disagreed, -1 for none
+  int index;
+  uint16_t pc; // Where it started
+  Lane *lane;
+} Divergence;
+
+static uint8_t rom[FUZZ_ROM_SIZE];
+
+// Table entries that have a handler, the others exit the interpreter. The
+// prefix itself is not drawn, it runs with every 0xCB entry.
+static uint16_t entries[TABLE_ENTRIES];
+static unsigned int entry_count;
+
+static uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+}
+
+static int implemented(int entry) {
+  if (entry < 256)
+    return opcode_table[entry] != not_implemented;
+  return special_opcode_table[entry - 256] != not_implemented;
+}
+
+static int entry_of(const Instruction *instruction) {
+  if (instruction->bytes[0] == 0xCB)
+    return 256 + instruction->bytes[1];
+  return instruction->bytes[0];
+}
+
+static int instruction_length(const Instruction *instruction) {
+  const uint8_t *bytes = instruction->bytes;
+  return bytes[0] == 0xCB ? 2 : opcode_lengths[bytes[0]];
+}
+
+// Often just past the PC, so stores land in the program laid out there
+static uint16_t random_pointer(uint64_t *state, uint16_t pc) {
+  uint64_t value = splitmix64(state);
+  if (value & 3)
+    return value >> 16;
+  return pc + (value >> 16) % 64;
+}
+
+static void random_case(Case *c, uint64_t seed, int length) {
+  uint64_t state = seed;
+  for (size_t i = 0; i < sizeof(c->high_memory); i++)
+    c->high_memory[i] = splitmix64(&state);
+
+  c->PC = CODE_START + splitmix64(&state) % (CODE_END - CODE_START - 2);
+  c->AF = splitmix64(&state) & 0xFFF0;
+  c->BC = splitmix64(&state);
+  c->DE = splitmix64(&state);
+  c->HL = random_pointer(&state, c->PC);
+  c->SP = random_pointer(&state, c->PC);
+  c->ime = splitmix64(&state) & 1;
+  c->speed_shift = splitmix64(&state) & 1;
+
+  c->length = length;
+  for (int i = 0; i < length; i++) {
+    uint64_t value = splitmix64(&state);
+    int entry = entries[value % entry_count];
+    uint8_t *bytes = c->program[i].bytes;
+    bytes[0] = entry < 256 ? entry : 0xCB;
+    bytes[1] = entry < 256 ? (uint8_t)(value >> 32) : entry - 256;
+    bytes[2] = value >> 40;
+  }
+}
+
+static void load_case(Lane *lane, const Case *c) {
+  CPU *cpu = &lane->cpu;
+  initialize_cpu(cpu, lane->memory);
+  cpu->wram_banks = lane->wram_banks;
+  load_cartridge(cpu, rom, sizeof(rom));
+  memcpy(lane->memory + 0x8000, c->high_memory, sizeof(c->high_memory));
+
+  cpu->AF = c->AF;
+  cpu->BC = c->BC;
+  cpu->DE = c->DE;
+  cpu->HL = c->HL;
+  cpu->SP = c->SP;
+  cpu->PC = c->PC;
+  cpu->ime = c->ime;
+  cpu->speed_shift = c->speed_shift;
+
+  // Blocks left from the last case were made from other code
+  cpu->jit = lane->jit;
+  if (cpu->jit != NULL)
+    jit_invalidate(cpu->jit, 0x0000, 0x10000);
+}
+
+// As far as it fits below CODE_END, the rest of work RAM stays random
+static void lay_out(Lane *lane, const Case *c) {
+  uint32_t address = c->PC;
+  for (int i = 0; i < c->length; i++) {
+    int length = instruction_length(&c->program[i]);
+    if (address + length > CODE_END)
+      break;
+    memcpy(lane->memory + address, c->program[i].bytes, length);
+    address += length;
+  }
+}
+
+static void step_lane(Lane *lane, const Instruction *instruction) {
+  CPU *cpu = &lane->cpu;
+  memcpy(lane->memory + cpu->PC, instruction->bytes, 3);
+  if (cpu->jit != NULL) {
+    jit_invalidate(cpu->jit, cpu->PC, cpu->PC + 3);
+    jit_step(cpu);
+  } else {
+    step(cpu);
+  }
+}
+
+static int same_state(const CPU *a, const CPU *b) {
+  return a->AF == b->AF && a->BC == b->BC && a->DE == b->DE &&
+         a->HL == b->HL && a->SP == b->SP && a->PC == b->PC &&
+         a->ime == b->ime && a->cycles == b->cycles && a->fault == b->fault &&
+         a->speed_shift == b->speed_shift && a->rom_bank == b->rom_bank &&
+         a->sram_enabled == b->sram_enabled && a->sram_bank == b->sram_bank &&
+         a->wram_bank == b->wram_bank &&
+         memcmp(a->memory, b->memory, 0x10000) == 0 &&
+         memcmp(a->wram_banks, b->wram_banks, WRAM_BANKS * WRAM_BANK_SIZE) == 0;
+}
+
+static Lane *differing_lane(Group *group) {
+  for (int i = 1; i < group->lane_count; i++)
+    if (!same_state(&group->lanes[0]->cpu, &group->lanes[i]->cpu))
+      return group->lanes[i];
+  return NULL;
+}
+
+// Run every lane through the case in lockstep, coverage counts the table
+// entries that ran when not NULL
+static Divergence run_steps(Group *group, const Case *c, uint64_t *coverage) {
+  Divergence divergence = {-1, 0, NULL};
+  for (int i = 0; i < c->length; i++) {
+    uint16_t pc = group->lanes[0]->cpu.PC;
+    if (pc < CODE_START || pc > CODE_END - 3)
+      break;
+    for (int j = 0; j < group->lane_count; j++)
+      step_lane(group->lanes[j], &c->program[i]);
+    if (coverage != NULL) {
+      coverage[entry_of(&c->program[i])]++;
+      if (c->program[i].bytes[0] == 0xCB)
+        coverage[0xCB]++;
+    }
+
+    divergence.lane = differing_lane(group);
+    if (divergence.lane != NULL) {
+      divergence.index = i;
+      divergence.pc = pc;
+      return divergence;
+    }
+  }
+  return divergence;
+}
+
+// The second lane runs a block, then the interpreter is stepped to its PC
+// and cycles, no further than a block can reach. Blocks are counted, a
+// loop may never leave the program.
+static Divergence run_blocks(Group *group, const Case *c, uint64_t *blocks) {
+  Divergence divergence = {-1, 0, NULL};
+  CPU *reference = &group->lanes[0]->cpu;
+  CPU *jit = &group->lanes[1]->cpu;
+  for (int i = 0; i < c->length && !reference->fault; i++) {
+    uint16_t pc = reference->PC;
+    if (pc < CODE_START || pc > CODE_END - 3)
+      break;
+    jit_step(jit);
+    for (int j = 0; j < JIT_MAX_INSTRUCTIONS && !reference->fault; j++) {
+      if (reference->cycles >= jit->cycles && reference->PC == jit->PC)
+        break;
+      step(reference);
+    }
+    if (blocks != NULL)
+      (*blocks)++;
+
+    divergence.lane = differing_lane(group);
+    if (divergence.lane != NULL) {
+      divergence.index = i;
+      divergence.pc = pc;
+      return divergence;
+    }
+  }
+  return divergence;
+}
+
+static Divergence run_case(Group *group, const Case *c, uint64_t *coverage,
+                           uint64_t *blocks) {
+  for (int i = 0; i < group->lane_count; i++) {
+    load_case(group->lanes[i], c);
+    if (group->mode == MODE_BLOCK)
+      lay_out(group->lanes[i], c);
+  }
+  if (group->mode == MODE_BLOCK)
+    return run_blocks(group, c, blocks);
+  return run_steps(group, c, coverage);
+}
+
+// Stepping, the instructions after the divergence are dropped right away
+static int diverges(Group *group, Case *c) {
+  Divergence divergence = run_case(group, c, NULL, NULL);
+  if (divergence.index < 0)
+    return 0;
+  if (group->mode == MODE_STEP)
+    c->length = divergence.index + 1;
+  return 1;
+}
+
+// Keep a simplification only when the case still diverges
+static void try_register(Group *group, Case *c, uint16_t *reg,
+                         uint16_t simple) {
+  uint16_t original = *reg;
+  if (original == simple)
+    return;
+  *reg = simple;
+  if (!diverges(group, c))
+    *reg = original;
+}
+
+static void try_byte(Group *group, Case *c, uint8_t *value) {
+  uint8_t original = *value;
+  if (original == 0)
+    return;
+  *value = 0;
+  if (!diverges(group, c))
+    *value = original;
+}
+
+// Drop instructions, then clear registers and memory that do not matter
+static void minimize(Group *group, Case *c) {
+  diverges(group, c);
+
+  // Stepping, the last instruction is the one that diverged
+  int kept = group->mode == MODE_STEP;
+  for (int i = c->length - 1 - kept; i >= 0; i--) {
+    if (i >= c->length - kept)
+      continue; // Diverged earlier since, the tail is already gone
+    Case candidate = *c;
+    memmove(&candidate.program[i], &candidate.program[i + 1],
+            (candidate.length - i - 1) * sizeof(Instruction));
+    candidate.length--;
+    if (diverges(group, &candidate))
+      *c = candidate;
+  }
+
+  try_register(group, c, &c->AF, 0x0000);
+  try_register(group, c, &c->BC, 0x0000);
+  try_register(group, c, &c->DE, 0x0000);
+  try_register(group, c, &c->HL, 0x0000);
+  try_register(group, c, &c->SP, 0xFFFE);
+  try_register(group, c, &c->PC, CODE_START);
+  try_byte(group, c, &c->ime);
+  try_byte(group, c, &c->speed_shift);
+
+  // Whole pages first, then single bytes of the pages that are left
+  uint8_t page_needed[0x80] = {0};
+  for (int page = 0; page < 0x80; page++) {
+    uint8_t *bytes = c->high_memory + page * 0x100;
+    uint8_t saved[0x100];
+    memcpy(saved, bytes, sizeof(saved));
+    memset(bytes, 0, sizeof(saved));
+    if (!diverges(group, c)) {
+      memcpy(bytes, saved, sizeof(saved));
+      page_needed[page] = 1;
+    }
+  }
+  for (int page = 0; page < 0x80; page++)
+    if (page_needed[page])
+      for (int i = 0; i < 0x100; i++)
+        try_byte(group, c, &c->high_memory[page * 0x100 + i]);
+
+  diverges(group, c);
+}
+
+static void print_cpu(const char *name, const CPU *cpu) {
+  fprintf(stderr,
+          "  %-11s AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X IME=%u "
+          "speed=%u cycles=%" PRIu64 " rom_bank=%u wram_bank=%u fault=%u\n",
+          name, cpu->AF, cpu->BC, cpu->DE, cpu->HL, cpu->SP, cpu->PC, cpu->ime,
+          cpu->speed_shift, cpu->cycles, cpu->rom_bank, cpu->wram_bank,
+          cpu->fault);
+}
+
+static void report(Group *group, const Case *c, uint64_t seed,
+                   uint64_t trial) {
+  Divergence divergence = run_case(group, c, NULL, NULL);
+  const char *name = engine_names[divergence.lane->engine];
+  if (group->mode == MODE_STEP)
+    fprintf(stderr, "The %s diverged from the interpreter after table entry "
+            "%03X", name, entry_of(&c->program[divergence.index]));
+  else
+    fprintf(stderr, "The %s diverged from the interpreter in the block run "
+            "from %04X", name, divergence.pc);
+  fprintf(stderr, ", reproduce with -s %" PRIu64 " -t %" PRIu64 " -n 1\n",
+          seed, trial);
+
+  fprintf(stderr, "Minimized case, the cartridge is made from the seed:\n");
+  fprintf(stderr,
+          "  AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X IME=%u speed=%u\n",
+          c->AF, c->BC, c->DE, c->HL, c->SP, c->PC, c->ime, c->speed_shift);
+  int printed = 0;
+  for (uint32_t i = 0; i < sizeof(c->high_memory); i++) {
+    if (c->high_memory[i] == 0)
+      continue;
+    if (printed++ < REPORTED_BYTES)
+      fprintf(stderr, "  memory[%04X]=%02X\n", 0x8000 + i, c->high_memory[i]);
+  }
+  if (printed > REPORTED_BYTES)
+    fprintf(stderr, "  ... %d more non-zero bytes\n", printed - REPORTED_BYTES);
+  for (int i = 0; i < c->length; i++) {
+    const uint8_t *bytes = c->program[i].bytes;
+    int length = instruction_length(&c->program[i]);
+    fprintf(stderr, "  %3d:", i);
+    for (int j = 0; j < length; j++)
+      fprintf(stderr, " %02X", bytes[j]);
+    fprintf(stderr, "\n");
+  }
+
+  fprintf(stderr, "State after the last instruction:\n");
+  const CPU *reference = &group->lanes[0]->cpu;
+  const CPU *other = &divergence.lane->cpu;
+  print_cpu(engine_names[ENGINE_INTERPRETER], reference);
+  print_cpu(name, other);
+  for (uint32_t address = 0; address < 0x10000; address++)
+    if (reference->memory[address] != other->memory[address])
+      fprintf(stderr, "  memory[%04X] %s=%02X interpreter=%02X\n", address,
+              name, other->memory[address], reference->memory[address]);
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-n trials] [-l length] [-s seed] [-t first]\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  uint64_t trials = 10000;
+  int length = 32;
+  uint64_t seed = current_time_ns();
+  uint64_t first = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:s:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      trials = strtoull(optarg, NULL, 10);
+      break;
+    case 'l':
+      length = strtol(optarg, NULL, 10);
+      if (length < 1 || length > MAX_LENGTH)
+        usage(argv[0]);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 't':
+      first = strtoull(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  for (int entry = 0; entry < TABLE_ENTRIES; entry++)
+    if (implemented(entry) && entry != 0xCB)
+      entries[entry_count++] = entry;
+
+  // A CGB cartridge, so speed switches and WRAM banking are reachable
+  uint64_t state = seed;
+  for (size_t i = 0; i < sizeof(rom); i++)
+    rom[i] = splitmix64(&state);
+  rom[0x143] = 0x80;
+
+  // Each mode has an interpreter of its own, the memory is laid out apart
+  Group groups[] = {{MODE_STEP, {NULL}, 0}, {MODE_BLOCK, {NULL}, 0}};
+  int group_count = sizeof(groups) / sizeof(groups[0]);
+  static const Engine engines[][2] = {
+      {ENGINE_INTERPRETER, ENGINE_JIT},
+      {ENGINE_INTERPRETER, ENGINE_JIT_BLOCKS},
+  };
+  for (int i = 0; i < group_count; i++) {
+    for (int j = 0; j < 2; j++) {
+      Lane *lane = calloc(1, sizeof(Lane));
+      if (lane == NULL) {
+        perror("Failed to allocate an engine lane.");
+        exit(EXIT_FAILURE);
+      }
+      lane->engine = engines[i][j];
+      if (lane->engine != ENGINE_INTERPRETER) {
+        lane->jit = jit_create(0);
+        if (lane->jit == NULL) {
+          free(lane);
+          continue;
+        }
+        lane->jit->single_step = lane->engine == ENGINE_JIT;
+        lane->jit->eager = 1;
+      }
+      groups[i].lanes[groups[i].lane_count++] = lane;
+    }
+    if (groups[i].lane_count < 2) {
+      fprintf(stderr, "No engine to compare with the interpreter.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  printf("Seed %" PRIu64 ", %u of %d table entries implemented\n", seed,
+         entry_count + 1, TABLE_ENTRIES);
+
+  static Case c;
+  static uint64_t coverage[TABLE_ENTRIES];
+  uint64_t instructions = 0;
+  uint64_t blocks = 0;
+  for (uint64_t trial = first; trial < first + trials; trial++) {
+    random_case(&c, seed ^ (trial * 0xD1B54A32D192ED03ull), length);
+    for (int i = 0; i < group_count; i++) {
+      Divergence divergence = run_case(&groups[i], &c, coverage, &blocks);
+      if (divergence.index >= 0) {
+        minimize(&groups[i], &c);
+        report(&groups[i], &c, seed, trial);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  int covered = 0;
+  for (int entry = 0; entry < TABLE_ENTRIES; entry++) {
+    if (entry != 0xCB)
+      instructions += coverage[entry];
+    covered += coverage[entry] != 0;
+  }
+  printf("%" PRIu64 " trials, %" PRIu64 " instructions, %" PRIu64
+         " blocks, %d of %u implemented table entries covered, no "
+         "divergence\n",
+         trials, instructions, blocks, covered, entry_count + 1);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,267 @@
+#include "gbemu.h"
+#include "apu.h"
+#include "cpu.h"
+#include "instance.h"
+#include "mmu.h"
+#include "ppu.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MIN_ROM_SIZE 0x150 // Up to the end of the cartridge header
+
+// Contexts are instances, so they can be forked from templates
+struct GBEmu {
+  Instance instance;
+};
+
+struct GBEmuTemplate {
+  Template *template;
+};
+
+struct GBEmuPool {
+  pthread_t *threads;
+  int thread_count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  uint64_t generation; // Bumped for every batch
+  int busy;            // Workers still on the current batch
+  int quit;
+
+  // Current batch, contexts are claimed one at a time through next
+  GBEmu *const *emus;
+  const uint8_t *inputs;
+  size_t count;
+  int frames;
+  uint32_t *framebuffers;
+  atomic_size_t next;
+  atomic_int faulted;
+};
+
+static void reset(GBEmu *emu) {
+  Instance *instance = &emu->instance;
+  memset(instance->memory, 0, sizeof(instance->memory));
+  initialize_cpu(&instance->cpu, instance->memory);
+  ppu_init(&instance->ppu, instance->memory, instance->output->framebuffer);
+  apu_init(&instance->apu, instance->memory + 0xFF10,
+           &instance->output->audio);
+  apu_set_synthesis(&instance->apu, 0, 0);
+  instance->cpu.ppu = &instance->ppu;
+  instance->ppu.bus = &instance->cpu;
+  instance->cpu.apu = &instance->apu;
+  instance->cpu.wram_banks = instance->wram_banks;
+}
+
+GBEmu *gbemu_create(void) {
+  GBEmu *emu = (GBEmu *)instance_create();
+  if (emu != NULL)
+    apu_set_synthesis(&emu->instance.apu, 0, 0);
+  return emu;
+}
+
+void gbemu_destroy(GBEmu *emu) {
+  if (emu == NULL)
+    return;
+  instance_destroy(&emu->instance);
+}
+
+int gbemu_load_rom(GBEmu *emu, const uint8_t *rom, size_t size) {
+  if (size < MIN_ROM_SIZE)
+    return -1;
+  uint8_t *copy = malloc(size);
+  if (copy == NULL)
+    return -1;
+  memcpy(copy, rom, size);
+
+  // A fork stops sharing the template's cartridge
+  if (emu->instance.template == NULL)
+    free(emu->instance.cpu.rom);
+  emu->instance.template = NULL;
+  reset(emu);
+  load_cartridge(&emu->instance.cpu, copy, size);
+  post_boot_state(&emu->instance.cpu);
+  return 0;
+}
+
+GBEmuTemplate *gbemu_template_create(const GBEmu *emu) {
+  GBEmuTemplate *template = malloc(sizeof(GBEmuTemplate));
+  if (template == NULL)
+    return NULL;
+  template->template = template_create(&emu->instance.cpu);
+  if (template->template == NULL) {
+    free(template);
+    return NULL;
+  }
+  return template;
+}
+
+void gbemu_template_destroy(GBEmuTemplate *template) {
+  if (template == NULL)
+    return;
+  template_destroy(template->template);
+  free(template);
+}
+
+GBEmu *gbemu_fork(const GBEmuTemplate *template) {
+  return (GBEmu *)instance_fork(template->template);
+}
+
+void gbemu_set_input(GBEmu *emu, uint8_t buttons) {
+  emu->instance.cpu.joypad = buttons;
+}
+
+// Only the last frame is composed, into target or the framebuffer when NULL
+static int run_frames(GBEmu *emu, int frames, uint32_t *target) {
+  CPU *cpu = &emu->instance.cpu;
+  PPU *ppu = &emu->instance.ppu;
+  for (int i = 0; i < frames && !cpu->fault; i++) {
+    ppu->render = i == frames - 1;
+    if (ppu->render)
+      ppu_set_target(ppu, target);
+    run_frame(cpu);
+  }
+  ppu_set_target(ppu, NULL);
+  return cpu->fault ? -1 : 0;
+}
+
+int gbemu_run_frames(GBEmu *emu, int frames) {
+  return run_frames(emu, frames, NULL);
+}
+
+int gbemu_faulted(const GBEmu *emu) { return emu->instance.cpu.fault; }
+
+const uint32_t *gbemu_framebuffer(const GBEmu *emu) {
+  return emu->instance.ppu.framebuffer;
+}
+
+uint8_t *gbemu_memory(GBEmu *emu) { return emu->instance.cpu.memory; }
+
+void gbemu_set_audio(GBEmu *emu, int enabled) {
+  apu_set_synthesis(&emu->instance.apu, enabled, emu->instance.cpu.cycles);
+}
+
+size_t gbemu_read_audio(GBEmu *emu, int16_t *samples, size_t frames) {
+  return apu_read_samples(&emu->instance.apu, samples, frames);
+}
+
+// Claim contexts of the current batch until there are none left
+static void run_batch_share(GBEmuPool *pool) {
+  for (;;) {
+    size_t i = atomic_fetch_add_explicit(&pool->next, 1, memory_order_relaxed);
+    if (i >= pool->count)
+      return;
+    GBEmu *emu = pool->emus[i];
+    if (pool->inputs != NULL)
+      emu->instance.cpu.joypad = pool->inputs[i];
+    // Drawn straight into the caller's buffer, the context's own
+    // framebuffer is left alone
+    if (run_frames(emu, pool->frames, pool->framebuffers + i * GBEMU_PIXELS))
+      atomic_store_explicit(&pool->faulted, 1, memory_order_relaxed);
+  }
+}
+
+static void *worker(void *arg) {
+  GBEmuPool *pool = arg;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->generation == seen && !pool->quit)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->quit)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_batch_share(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+GBEmuPool *gbemu_pool_create(int threads) {
+  if (threads <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+
+  GBEmuPool *pool = calloc(1, sizeof(GBEmuPool));
+  if (pool == NULL)
+    return NULL;
+  // The caller is one of the threads working on a batch
+  pool->threads = calloc(threads, sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (int i = 0; i < threads - 1; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0) {
+      gbemu_pool_destroy(pool);
+      return NULL;
+    }
+    pool->thread_count++;
+  }
+  return pool;
+}
+
+void gbemu_pool_destroy(GBEmuPool *pool) {
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->thread_count; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  free(pool->threads);
+  free(pool);
+}
+
+int gbemu_run_batch(GBEmuPool *pool, GBEmu *const *emus,
+                    const uint8_t *inputs, size_t count, int frames,
+                    uint32_t *framebuffers) {
+  pool->emus = emus;
+  pool->inputs = inputs;
+  pool->count = count;
+  pool->frames = frames;
+  pool->framebuffers = framebuffers;
+  atomic_store_explicit(&pool->next, 0, memory_order_relaxed);
+  atomic_store_explicit(&pool->faulted, 0, memory_order_relaxed);
+
+  // A single context is not worth waking anyone
+  int shared = count > 1 && pool->thread_count > 0;
+  if (shared) {
+    pthread_mutex_lock(&pool->lock);
+    pool->busy = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  run_batch_share(pool);
+
+  if (shared) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0)
+      pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return atomic_load_explicit(&pool->faulted, memory_order_relaxed) ? -1 : 0;
+}
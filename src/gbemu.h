@@ -0,0 +1,87 @@
+#ifndef GBEMU_NEOSAHADEO
+#define GBEMU_NEOSAHADEO
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// Embedding API of libgbemu. Contexts are independent, one may be driven
+// per thread, and a pool steps many of them at once.
+
+#define GBEMU_API __attribute__((visibility("default")))
+
+#define GBEMU_WIDTH 160
+#define GBEMU_HEIGHT 144
+#define GBEMU_PIXELS (GBEMU_WIDTH * GBEMU_HEIGHT)
+
+// Input bits, same as CPU.joypad
+#define GBEMU_RIGHT 0x01
+#define GBEMU_LEFT 0x02
+#define GBEMU_UP 0x04
+#define GBEMU_DOWN 0x08
+#define GBEMU_A 0x10
+#define GBEMU_B 0x20
+#define GBEMU_SELECT 0x40
+#define GBEMU_START 0x80
+
+typedef struct GBEmu GBEmu;
+typedef struct GBEmuTemplate GBEmuTemplate;
+typedef struct GBEmuPool GBEmuPool;
+
+// NULL when out of memory
+GBEMU_API GBEmu *gbemu_create(void);
+GBEMU_API void gbemu_destroy(GBEmu *emu);
+
+// Copies the ROM and resets the context to the state the boot ROM leaves
+// behind. Returns -1 when the ROM is too small or can't be copied.
+GBEMU_API int gbemu_load_rom(GBEmu *emu, const uint8_t *rom, size_t size);
+
+// Freeze a context so many can be forked from it. Forks share the
+// cartridge and every page of the machine they do not write to, only
+// what they write is private. Templates must outlive their forks.
+GBEMU_API GBEmuTemplate *gbemu_template_create(const GBEmu *emu);
+GBEMU_API void gbemu_template_destroy(GBEmuTemplate *template);
+GBEMU_API GBEmu *gbemu_fork(const GBEmuTemplate *template);
+
+GBEMU_API void gbemu_set_input(GBEmu *emu, uint8_t buttons);
+
+// Run whole frames, only the last one is drawn into the framebuffer.
+// Returns -1 when the game ran an instruction the emulator does not
+// implement. The context stops in front of whatever follows it and every
+// further run returns -1 until a ROM is loaded again.
+GBEMU_API int gbemu_run_frames(GBEmu *emu, int frames);
+
+// Nonzero once a run returned -1
+GBEMU_API int gbemu_faulted(const GBEmu *emu);
+
+// 0xRRGGBBAA pixels of the last frame drawn by gbemu_run_frames, valid
+// until the next run. Batches draw into their own buffers instead, and a
+// fork's are all zero until it draws one.
+GBEMU_API const uint32_t *gbemu_framebuffer(const GBEmu *emu);
+
+// The 64 KiB memory map, writes bypass the bus
+GBEMU_API uint8_t *gbemu_memory(GBEmu *emu);
+
+// Sound is off until enabled, it costs time nobody training an agent
+// listens to. Samples are interleaved stereo at GBEMU_SAMPLE_RATE and
+// must be read regularly once enabled, the ring drops what does not fit.
+#define GBEMU_SAMPLE_RATE 48000
+GBEMU_API void gbemu_set_audio(GBEmu *emu, int enabled);
+GBEMU_API size_t gbemu_read_audio(GBEmu *emu, int16_t *samples, size_t frames);
+
+// Pool of worker threads for gbemu_run_batch, 0 threads uses one per
+// online core. NULL when the threads can't be started.
+GBEMU_API GBEmuPool *gbemu_pool_create(int threads);
+GBEMU_API void gbemu_pool_destroy(GBEmuPool *pool);
+
+// Set inputs[i] on emus[i], run each for `frames` frames and copy their
+// framebuffers to framebuffers + i * GBEMU_PIXELS. inputs may be NULL to
+// keep the current input. The calling thread works too and the call
+// returns once every context is done. A context may only appear once.
+// Returns -1 when any context faulted, gbemu_faulted tells which. Their
+// framebuffers are left as they were when the fault came before the last
+// frame.
+GBEMU_API int gbemu_run_batch(GBEmuPool *pool, GBEmu *const *emus,
+                               const uint8_t *inputs, size_t count,
+                               int frames, uint32_t *framebuffers);
+
+#endif
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "instance.h"
+#include "mmu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Point the parts of an instance at each other
+static void link_parts(Instance *instance, InstanceOutput *output) {
+  instance->cpu.memory = instance->memory;
+  instance->cpu.ppu = &instance->ppu;
+  instance->cpu.apu = &instance->apu;
+  instance->cpu.wram_banks = instance->wram_banks;
+  instance->ppu.memory = instance->memory;
+  instance->ppu.bus = &instance->cpu;
+  instance->ppu.framebuffer = output->framebuffer;
+  instance->apu.registers = instance->memory + 0xFF10;
+  instance->apu.buffers = &output->audio;
+  instance->output = output;
+}
+
+// Anonymous, so pages cost nothing until they are drawn or synthesized to
+static InstanceOutput *map_output(void) {
+  InstanceOutput *output = mmap(NULL, sizeof(InstanceOutput),
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (output == MAP_FAILED) {
+    perror("Failed to map the output of an instance.");
+    return NULL;
+  }
+  return output;
+}
+
+Instance *instance_create(void) {
+  InstanceOutput *output = map_output();
+  if (output == NULL)
+    return NULL;
+  Instance *instance = mmap(NULL, sizeof(Instance), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (instance == MAP_FAILED) {
+    perror("Failed to map an instance.");
+    munmap(output, sizeof(InstanceOutput));
+    return NULL;
+  }
+
+  initialize_cpu(&instance->cpu, instance->memory);
+  ppu_init(&instance->ppu, instance->memory, output->framebuffer);
+  apu_init(&instance->apu, instance->memory + 0xFF10, &output->audio);
+  link_parts(instance, output);
+  instance->template = NULL;
+  return instance;
+}
+
+void instance_destroy(Instance *instance) {
+  if (instance == NULL)
+    return;
+  if (instance->template == NULL)
+    free(instance->cpu.rom);
+  munmap(instance->output, sizeof(InstanceOutput));
+  munmap(instance, sizeof(Instance));
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written <= 0)
+      return -1;
+    bytes += written;
+    size -= written;
+  }
+  return 0;
+}
+
+// Freeze the machine into the template's file
+static int write_frozen(Template *template, const CPU *cpu) {
+  Instance *frozen = malloc(sizeof(Instance));
+  if (frozen == NULL)
+    return -1;
+
+  // Host side state does not carry over, every fork links its own parts
+  memcpy(frozen->memory, cpu->memory, sizeof(frozen->memory));
+  frozen->cpu = *cpu;
+  frozen->cpu.rom = template->rom;
+  if (cpu->rom_window != NULL)
+    frozen->cpu.rom_window = template->rom + (cpu->rom_window - cpu->rom);
+  frozen->cpu.sram = NULL;
+  frozen->cpu.sram_size = 0;
+  frozen->cpu.sram_fd = -1;
+  frozen->cpu.serial_out = NULL;
+  frozen->cpu.jit = NULL;
+  frozen->cpu.aot = NULL;
+  frozen->cpu.debugger = NULL;
+  frozen->cpu.watch_pages = NULL;
+  if (cpu->ppu != NULL)
+    frozen->ppu = *cpu->ppu;
+  else
+    ppu_init(&frozen->ppu, frozen->memory, NULL);
+  frozen->ppu.target = NULL;
+  frozen->ppu.framebuffer = NULL;
+  if (cpu->cgb && cpu->wram_banks != NULL)
+    memcpy(frozen->wram_banks, cpu->wram_banks, sizeof(frozen->wram_banks));
+  if (cpu->apu != NULL)
+    frozen->apu = *cpu->apu;
+  else
+    apu_init(&frozen->apu, frozen->memory + 0xFF10, NULL);
+  frozen->apu.buffers = NULL;
+  frozen->template = template;
+  frozen->output = NULL;
+
+  int result = write_all(template->fd, frozen, sizeof(Instance));
+  free(frozen);
+  return result;
+}
+
+Template *template_create(const CPU *cpu) {
+  Template *template = malloc(sizeof(Template));
+  if (template == NULL) {
+    perror("Failed to allocate a template.");
+    return NULL;
+  }
+  template->fd = memfd_create("gbemu-template", MFD_CLOEXEC);
+  template->rom_fd = memfd_create("gbemu-rom", MFD_CLOEXEC);
+  template->rom = NULL;
+  template->rom_size = cpu->rom_size;
+
+  if (template->fd < 0 || template->rom_fd < 0 ||
+      write_all(template->rom_fd, cpu->rom, cpu->rom_size) != 0) {
+    perror("Failed to write the template ROM.");
+    template_destroy(template);
+    return NULL;
+  }
+  if (cpu->rom_size > 0) {
+    template->rom = mmap(NULL, cpu->rom_size, PROT_READ, MAP_SHARED,
+                         template->rom_fd, 0);
+    if (template->rom == MAP_FAILED) {
+      perror("Failed to map the template ROM.");
+      template->rom = NULL;
+      template_destroy(template);
+      return NULL;
+    }
+  }
+
+  if (write_frozen(template, cpu) != 0) {
+    perror("Failed to write the template.");
+    template_destroy(template);
+    return NULL;
+  }
+  return template;
+}
+
+void template_destroy(Template *template) {
+  if (template == NULL)
+    return;
+  if (template->rom != NULL)
+    munmap(template->rom, template->rom_size);
+  if (template->fd >= 0)
+    close(template->fd);
+  if (template->rom_fd >= 0)
+    close(template->rom_fd);
+  free(template);
+}
+
+Instance *instance_fork(const Template *template) {
+  InstanceOutput *output = map_output();
+  if (output == NULL)
+    return NULL;
+  Instance *instance = mmap(NULL, sizeof(Instance), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, template->fd, 0);
+  if (instance == MAP_FAILED) {
+    perror("Failed to fork an instance.");
+    munmap(output, sizeof(InstanceOutput));
+    return NULL;
+  }
+  link_parts(instance, output);
+  return instance;
+}
@@ -0,0 +1,58 @@
+#ifndef INSTANCE_NEOSAHADEO
+#define INSTANCE_NEOSAHADEO
+
+#include "apu.h"
+#include "cpu.h"
+#include "ppu.h"
+#include <stddef.h>
+
+// A whole machine in one page aligned mapping, so it can be shared page by
+// page. Instances forked from a template map the template's file
+// privately: the kernel copies a page the first time an instance writes
+// to it, everything else stays shared. The cartridge lives in a separate
+// file mapped once, every instance reads its banks in place.
+//
+// What an instance ends up owning in that mapping is the RAM it writes
+// (VRAM, WRAM, OAM, HRAM, I/O) and the pages holding CPU, PPU and APU
+// state. Its framebuffer and audio buffers are output, not state, and live
+// in an InstanceOutput mapped apart. Frames drawn for gbemu_run_batch go to
+// the caller's buffer, so those pages are only backed once an instance
+// renders or synthesizes on its own.
+typedef struct InstanceOutput {
+  uint32_t framebuffer[LCD_WIDTH * LCD_HEIGHT];
+  AudioBuffers audio;
+} InstanceOutput;
+
+typedef struct Instance {
+  uint8_t memory[0x10000]; // First, so it starts on a page
+  CPU cpu;
+  PPU ppu;
+  APU apu;
+  const struct Template *template; // NULL when the instance owns its ROM
+  InstanceOutput *output; // Every fork maps its own, all zero at first
+  // Only touched by CGB cartridges, the pages stay unused otherwise
+  uint8_t wram_banks[WRAM_BANKS][WRAM_BANK_SIZE];
+} Instance;
+
+typedef struct Template {
+  int fd; // An Instance frozen when the template was made
+  int rom_fd;
+  uint8_t *rom; // Read only view of rom_fd, shared by every fork
+  size_t rom_size;
+} Template;
+
+// An instance of its own, set up like initialize_cpu, ppu_init and
+// apu_init would. NULL when it can't be mapped.
+Instance *instance_create(void);
+void instance_destroy(Instance *instance);
+
+// Freeze the machine the CPU belongs to, typically just after boot or at
+// the start of a level. The engines, debugger, save file and serial hook
+// are not part of it. NULL when the files can't be created.
+Template *template_create(const CPU *cpu);
+// Forks hold on to the template, it must outlive them
+void template_destroy(Template *template);
+
+Instance *instance_fork(const Template *template);
+
+#endif
@@ -0,0 +1,732 @@
+#define _GNU_SOURCE
+#include "jit.h"
+#include "cpu.h"
+#include "debugger.h"
+#include "mmu.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Guest register pairs live in callee saved host registers for the whole
+// block, so handler calls only have to spill them, not save them.
+#define HOST_AX 0
+#define HOST_CX 1
+#define HOST_DX 2
+#define HOST_CPU 3 // rbx
+#define HOST_SP 5  // ebp
+#define HOST_AF 12
+#define HOST_BC 13
+#define HOST_DE 14
+#define HOST_HL 15
+
+// Group 1 ALU extensions and opcodes
+#define ALU_ADD 0
+#define ALU_OR 1
+#define ALU_AND 4
+#define ALU_XOR 6
+#define SHIFT_SHL 4
+#define SHIFT_SHR 5
+#define CC_NE 0x5
+
+// Worst case bytes for one translated instruction plus the block exits
+#define INSTRUCTION_CODE_SIZE 192
+#define BLOCK_CODE_SIZE                                                        \
+  (JIT_MAX_INSTRUCTIONS * INSTRUCTION_CODE_SIZE + 4 * INSTRUCTION_CODE_SIZE)
+
+#define JIT_UNCOMPILABLE 0xFF
+#define MAX_BLOCK_BYTES (JIT_MAX_INSTRUCTIONS * 3) // Longest code one block covers
+
+typedef struct Emitter {
+  uint8_t *code;
+  size_t size;
+} Emitter;
+
+static void emit8(Emitter *e, uint8_t value) { e->code[e->size++] = value; }
+
+static void emit16(Emitter *e, uint16_t value) {
+  memcpy(e->code + e->size, &value, sizeof(value));
+  e->size += sizeof(value);
+}
+
+static void emit32(Emitter *e, uint32_t value) {
+  memcpy(e->code + e->size, &value, sizeof(value));
+  e->size += sizeof(value);
+}
+
+static void emit64(Emitter *e, uint64_t value) {
+  memcpy(e->code + e->size, &value, sizeof(value));
+  e->size += sizeof(value);
+}
+
+static void emit_rex(Emitter *e, int wide, int reg, int rm) {
+  if (wide || reg >= 8 || rm >= 8)
+    emit8(e, 0x40 | wide << 3 | (reg >= 8) << 2 | (rm >= 8));
+}
+
+static void emit_modrm(Emitter *e, int mod, int reg, int rm) {
+  emit8(e, mod << 6 | (reg & 7) << 3 | (rm & 7));
+}
+
+// mov dst, src (32 bit)
+static void emit_mov(Emitter *e, int dst, int src) {
+  emit_rex(e, 0, src, dst);
+  emit8(e, 0x89);
+  emit_modrm(e, 3, src, dst);
+}
+
+// mov dst, imm32
+static void emit_mov_imm(Emitter *e, int dst, uint32_t value) {
+  emit_rex(e, 0, 0, dst);
+  emit8(e, 0xB8 + (dst & 7));
+  emit32(e, value);
+}
+
+// add/or/and/xor dst, imm32
+static void emit_alu_imm(Emitter *e, int op, int dst, uint32_t value) {
+  emit_rex(e, 0, 0, dst);
+  emit8(e, 0x81);
+  emit_modrm(e, 3, op, dst);
+  emit32(e, value);
+}
+
+// add/or/and/xor dst, src
+static void emit_alu(Emitter *e, int op, int dst, int src) {
+  emit_rex(e, 0, src, dst);
+  emit8(e, op << 3 | 0x01);
+  emit_modrm(e, 3, src, dst);
+}
+
+static void emit_shift(Emitter *e, int op, int dst, uint8_t count) {
+  emit_rex(e, 0, 0, dst);
+  emit8(e, 0xC1);
+  emit_modrm(e, 3, op, dst);
+  emit8(e, count);
+}
+
+// test dst, imm32
+static void emit_test_imm(Emitter *e, int dst, uint32_t value) {
+  emit_rex(e, 0, 0, dst);
+  emit8(e, 0xF7);
+  emit_modrm(e, 3, 0, dst);
+  emit32(e, value);
+}
+
+// edx = ZF ? FLAG_Z : 0, after a test or an ALU operation
+static void emit_zero_flag(Emitter *e) {
+  emit8(e, 0x0F), emit8(e, 0x94), emit8(e, 0xC2); // sete dl
+  emit8(e, 0x0F), emit8(e, 0xB6), emit8(e, 0xD2); // movzx edx, dl
+  emit_shift(e, SHIFT_SHL, HOST_DX, 7);
+}
+
+// movzx reg, word [rbx + offset]
+static void emit_load16(Emitter *e, int reg, size_t offset) {
+  emit_rex(e, 0, reg, HOST_CPU);
+  emit8(e, 0x0F), emit8(e, 0xB7);
+  emit_modrm(e, 2, reg, HOST_CPU);
+  emit32(e, offset);
+}
+
+// mov word [rbx + offset], reg
+static void emit_store16(Emitter *e, size_t offset, int reg) {
+  emit8(e, 0x66);
+  emit_rex(e, 0, reg, HOST_CPU);
+  emit8(e, 0x89);
+  emit_modrm(e, 2, reg, HOST_CPU);
+  emit32(e, offset);
+}
+
+// mov word [rbx + offset], imm16
+static void emit_store16_imm(Emitter *e, size_t offset, uint16_t value) {
+  emit8(e, 0x66), emit8(e, 0xC7);
+  emit_modrm(e, 2, 0, HOST_CPU);
+  emit32(e, offset);
+  emit16(e, value);
+}
+
+// add qword [rbx + offset], imm32
+static void emit_add64_imm(Emitter *e, size_t offset, uint32_t value) {
+  emit8(e, 0x48), emit8(e, 0x81);
+  emit_modrm(e, 2, ALU_ADD, HOST_CPU);
+  emit32(e, offset);
+  emit32(e, value);
+}
+
+// jcc rel32, returns the offset of the displacement for patching
+static size_t emit_jcc(Emitter *e, int condition) {
+  emit8(e, 0x0F), emit8(e, 0x80 | condition);
+  emit32(e, 0);
+  return e->size - 4;
+}
+
+static void patch_jump(Emitter *e, size_t displacement, size_t target) {
+  int32_t relative = target - (displacement + 4);
+  memcpy(e->code + displacement, &relative, sizeof(relative));
+}
+
+static void emit_load_registers(Emitter *e) {
+  emit_load16(e, HOST_AF, offsetof(CPU, AF));
+  emit_load16(e, HOST_BC, offsetof(CPU, BC));
+  emit_load16(e, HOST_DE, offsetof(CPU, DE));
+  emit_load16(e, HOST_HL, offsetof(CPU, HL));
+  emit_load16(e, HOST_SP, offsetof(CPU, SP));
+}
+
+static void emit_store_registers(Emitter *e) {
+  emit_store16(e, offsetof(CPU, AF), HOST_AF);
+  emit_store16(e, offsetof(CPU, BC), HOST_BC);
+  emit_store16(e, offsetof(CPU, DE), HOST_DE);
+  emit_store16(e, offsetof(CPU, HL), HOST_HL);
+  emit_store16(e, offsetof(CPU, SP), HOST_SP);
+}
+
+// Registers and cycles as the interpreter would see them before an
+// instruction at pc, with the opcode already fetched
+static void emit_sync(Emitter *e, uint16_t pc, uint32_t cycles) {
+  emit_store_registers(e);
+  emit_store16_imm(e, offsetof(CPU, PC), pc);
+  if (cycles > 0)
+    emit_add64_imm(e, offsetof(CPU, cycles), cycles);
+}
+
+static const int pushed[] = {HOST_CPU, HOST_SP, HOST_AF,
+                             HOST_BC,  HOST_DE, HOST_HL};
+
+static void emit_prologue(Emitter *e) {
+  for (int i = 0; i < 6; i++) {
+    emit_rex(e, 0, 0, pushed[i]);
+    emit8(e, 0x50 + (pushed[i] & 7));
+  }
+  emit8(e, 0x48), emit8(e, 0x83), emit8(e, 0xEC), emit8(e, 0x08); // sub rsp, 8
+  emit8(e, 0x48), emit8(e, 0x89), emit8(e, 0xFB); // mov rbx, rdi
+  emit_load_registers(e);
+}
+
+static void emit_epilogue(Emitter *e) {
+  emit8(e, 0x48), emit8(e, 0x83), emit8(e, 0xC4), emit8(e, 0x08); // add rsp, 8
+  for (int i = 5; i >= 0; i--) {
+    emit_rex(e, 0, 0, pushed[i]);
+    emit8(e, 0x58 + (pushed[i] & 7));
+  }
+  emit8(e, 0xC3); // ret
+}
+
+static void emit_exit(Emitter *e, uint16_t pc, uint32_t cycles) {
+  emit_sync(e, pc, cycles);
+  emit_epilogue(e);
+}
+
+// eax = 8 bit half of a register pair
+static void emit_get8(Emitter *e, int pair, int high) {
+  emit_mov(e, HOST_AX, pair);
+  if (high)
+    emit_shift(e, SHIFT_SHR, HOST_AX, 8);
+  else
+    emit_alu_imm(e, ALU_AND, HOST_AX, 0xFF);
+}
+
+// 8 bit half of a register pair = eax, eax must already be in 0 - 255
+static void emit_set8(Emitter *e, int pair, int high) {
+  if (high) {
+    emit_shift(e, SHIFT_SHL, HOST_AX, 8);
+    emit_alu_imm(e, ALU_AND, pair, 0x00FF);
+  } else {
+    emit_alu_imm(e, ALU_AND, pair, 0xFF00);
+  }
+  emit_alu(e, ALU_OR, pair, HOST_AX);
+}
+
+// Replace the flags in mask with ecx, which only holds bits inside mask
+static void emit_set_flags(Emitter *e, uint8_t mask) {
+  emit_alu_imm(e, ALU_AND, HOST_AF, 0xFFFF & ~mask);
+  emit_alu(e, ALU_OR, HOST_AF, HOST_CX);
+}
+
+// INC r8 and DEC r8: Z, N and H change, C is kept
+static void emit_inc_dec8(Emitter *e, int pair, int high, int decrement) {
+  emit_get8(e, pair, high);
+  emit_mov(e, HOST_CX, HOST_AX);
+  emit_alu_imm(e, ALU_ADD, HOST_AX, decrement ? 0xFFFFFFFF : 1);
+  emit_alu_imm(e, ALU_AND, HOST_AX, 0xFF);
+
+  // Bit 4 flips exactly when the low nibble carries or borrows
+  emit_alu(e, ALU_XOR, HOST_CX, HOST_AX);
+  emit_alu_imm(e, ALU_AND, HOST_CX, 0x10);
+  emit_shift(e, SHIFT_SHL, HOST_CX, 1);
+  emit_test_imm(e, HOST_AX, 0xFF);
+  emit_zero_flag(e);
+  emit_alu(e, ALU_OR, HOST_CX, HOST_DX);
+  if (decrement)
+    emit_alu_imm(e, ALU_OR, HOST_CX, 0x40);
+
+  emit_set_flags(e, 0xE0);
+  emit_set8(e, pair, high);
+}
+
+// RLA and RL r8: rotate left through carry. RLA always clears Z.
+static void emit_rotate_left(Emitter *e, int pair, int high, int zero_flag) {
+  emit_get8(e, pair, high);
+  emit_mov(e, HOST_CX, HOST_AF);
+  emit_shift(e, SHIFT_SHR, HOST_CX, 4);
+  emit_alu_imm(e, ALU_AND, HOST_CX, 1);
+  emit_shift(e, SHIFT_SHL, HOST_AX, 1);
+  emit_alu(e, ALU_OR, HOST_AX, HOST_CX);
+
+  // Bit 8 of the result is the new carry
+  emit_mov(e, HOST_CX, HOST_AX);
+  emit_shift(e, SHIFT_SHR, HOST_CX, 4);
+  emit_alu_imm(e, ALU_AND, HOST_CX, 0x10);
+  emit_alu_imm(e, ALU_AND, HOST_AX, 0xFF);
+  if (zero_flag) {
+    emit_zero_flag(e);
+    emit_alu(e, ALU_OR, HOST_CX, HOST_DX);
+  }
+
+  emit_set_flags(e, 0xF0);
+  emit_set8(e, pair, high);
+}
+
+// Translate instructions that only touch registers. Returns 0 when the
+// instruction has to go through its interpreter handler instead.
+static int emit_native(Emitter *e, const uint8_t *code) {
+  switch (code[0]) {
+  case 0x00: // NOP
+    return 1;
+  case 0x05: // DEC B
+    emit_inc_dec8(e, HOST_BC, 1, 1);
+    return 1;
+  case 0x06: // LD B, n8
+    emit_mov_imm(e, HOST_AX, code[1]);
+    emit_set8(e, HOST_BC, 1);
+    return 1;
+  case 0x0C: // INC C
+    emit_inc_dec8(e, HOST_BC, 0, 0);
+    return 1;
+  case 0x0E: // LD C, n8
+    emit_mov_imm(e, HOST_AX, code[1]);
+    emit_set8(e, HOST_BC, 0);
+    return 1;
+  case 0x11: // LD DE, n16
+    emit_mov_imm(e, HOST_DE, code[2] << 8 | code[1]);
+    return 1;
+  case 0x17: // RLA
+    emit_rotate_left(e, HOST_AF, 1, 0);
+    return 1;
+  case 0x21: // LD HL, n16
+    emit_mov_imm(e, HOST_HL, code[2] << 8 | code[1]);
+    return 1;
+  case 0x23: // INC HL
+    emit_alu_imm(e, ALU_ADD, HOST_HL, 1);
+    emit_alu_imm(e, ALU_AND, HOST_HL, 0xFFFF);
+    return 1;
+  case 0x31: // LD SP, n16
+    emit_mov_imm(e, HOST_SP, code[2] << 8 | code[1]);
+    return 1;
+  case 0x3E: // LD A, n8
+    emit_mov_imm(e, HOST_AX, code[1]);
+    emit_set8(e, HOST_AF, 1);
+    return 1;
+  case 0x4F: // LD C, A
+    emit_get8(e, HOST_AF, 1);
+    emit_set8(e, HOST_BC, 0);
+    return 1;
+  case 0xAF: // XOR A, A
+    emit_alu_imm(e, ALU_AND, HOST_AF, 0x0F);
+    emit_alu_imm(e, ALU_OR, HOST_AF, 0x80);
+    return 1;
+  case 0xCB:
+    switch (code[1]) {
+    case 0x11: // RL C
+      emit_rotate_left(e, HOST_BC, 0, 1);
+      return 1;
+    case 0x7C: // BIT 7, H
+      emit_mov(e, HOST_CX, HOST_HL);
+      emit_shift(e, SHIFT_SHR, HOST_CX, 8);
+      emit_alu_imm(e, ALU_AND, HOST_CX, 0x80);
+      emit_alu_imm(e, ALU_XOR, HOST_CX, 0xA0);
+      emit_set_flags(e, 0xE0);
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+// Call the interpreter's handler for one instruction. Memory and I/O
+// accesses go through here so the bus sees up to date registers and cycles.
+static void emit_handler_call(Emitter *e, JIT *jit, uint16_t pc,
+                              uint8_t opcode, uint32_t cycles,
+                              size_t *invalidated_exits, size_t *exit_count) {
+  emit_sync(e, pc + 1, cycles);
+  emit8(e, 0x48), emit8(e, 0x89), emit8(e, 0xDF); // mov rdi, rbx
+  emit8(e, 0x48), emit8(e, 0xB8);                 // mov rax, imm64
+  emit64(e, (uint64_t)(uintptr_t)opcode_table[opcode]);
+  emit8(e, 0xFF), emit8(e, 0xD0); // call rax
+
+  if (opcode_flow[opcode] != FLOW_NONE) {
+    // The handler left PC and any taken branch cycles in the CPU
+    emit_epilogue(e);
+    return;
+  }
+  emit_load_registers(e);
+
+  // A write into this block's code drops it, bail out before running stale
+  // instructions. PC was advanced past the operands by the handler.
+  emit8(e, 0x48), emit8(e, 0xB8); // mov rax, imm64
+  emit64(e, (uint64_t)(uintptr_t)&jit->invalidated);
+  emit8(e, 0x80), emit8(e, 0x38), emit8(e, 0x00); // cmp byte [rax], 0
+  invalidated_exits[(*exit_count)++] = emit_jcc(e, CC_NE);
+}
+
+// End of the region a block starting at pc may cover, 0 when code there
+// is not compiled. VRAM, cartridge RAM, OAM and I/O always interpret. The
+// switchable ROM and WRAM banks are not contiguous with what comes before
+// them in host memory.
+static uint32_t region_end(uint16_t pc) {
+  if (pc < ROM_BANK_SIZE)
+    return ROM_BANK_SIZE;
+  if (pc < 2 * ROM_BANK_SIZE)
+    return 2 * ROM_BANK_SIZE;
+  if (pc >= 0xC000 && pc < 0xD000)
+    return 0xD000;
+  if (pc >= 0xD000 && pc < 0xE000)
+    return 0xE000;
+  if (pc >= 0xFF80 && pc < 0xFFFF)
+    return 0xFFFF;
+  return 0;
+}
+
+// Host address of the code at pc, switchable banks are read in place
+static const uint8_t *code_at(const CPU *cpu, uint32_t pc) {
+  if (cpu->rom_window != NULL && pc >= ROM_BANK_SIZE && pc < 2 * ROM_BANK_SIZE)
+    return cpu->rom_window + (pc - ROM_BANK_SIZE);
+  if (pc >= 0xD000 && pc < 0xE000 && cpu->wram_bank > 1)
+    return cpu->wram_banks[cpu->wram_bank] + (pc - 0xD000);
+  return cpu->memory + pc;
+}
+
+// Where the block starting at pc is kept, see JIT_KEYS
+static uint32_t block_key(const CPU *cpu, uint16_t pc) {
+  if (cpu->rom_window != NULL && pc >= ROM_BANK_SIZE && pc < 2 * ROM_BANK_SIZE)
+    return 0x10000 + (cpu->rom_window - cpu->rom) + (pc - ROM_BANK_SIZE);
+  return pc;
+}
+
+static int translatable(const CPU *cpu, uint32_t pc, uint32_t end) {
+  const uint8_t *code = code_at(cpu, pc);
+  uint8_t opcode = code[0];
+  if (opcode_table[opcode] == not_implemented)
+    return 0;
+  if (pc + opcode_lengths[opcode] > end)
+    return 0;
+  if (opcode == 0xCB && special_opcode_table[code[1]] == not_implemented)
+    return 0;
+  return 1;
+}
+
+static void mark_pages(JIT *jit, Block *block, int count) {
+  for (uint32_t page = block->start >> 8; page <= (block->end - 1) >> 8;
+       page++)
+    jit->code_pages[page] += count;
+}
+
+static void flush(JIT *jit) {
+  jit->code_used = 0;
+  jit->block_count = 0;
+  memset(jit->lookup, 0, sizeof(jit->lookup));
+  memset(jit->heat, 0, sizeof(jit->heat));
+  memset(jit->code_pages, 0, sizeof(jit->code_pages));
+}
+
+static Block *compile(JIT *jit, CPU *cpu, uint32_t key, uint16_t start) {
+  uint32_t end = region_end(start);
+  if (end == 0 || !translatable(cpu, start, end))
+    return NULL;
+
+  if (jit->code_used + BLOCK_CODE_SIZE > JIT_CODE_SIZE ||
+      jit->block_count == JIT_MAX_BLOCKS)
+    flush(jit);
+
+  Emitter e = {jit->code_write + jit->code_used, 0};
+  size_t invalidated_exits[JIT_MAX_INSTRUCTIONS];
+  size_t exit_count = 0;
+  int limit = jit->single_step ? 1 : JIT_MAX_INSTRUCTIONS;
+
+  emit_prologue(&e);
+
+  // Cycles of native instructions are only added to the CPU when the block
+  // exits or hands an instruction to the interpreter. Blocks are dropped on
+  // speed switches, so the speed they were compiled at is a constant.
+  int shift = cpu->speed_shift;
+  uint32_t pc = start;
+  uint32_t cycles = 0;
+  int instructions = 0;
+  int terminated = 0;
+  while (instructions < limit && pc < end &&
+         translatable(cpu, pc, end)) {
+    // Breakpoints are only seen between blocks
+    if (pc != start && cpu->debugger != NULL &&
+        debugger_breakpoint(cpu->debugger, pc))
+      break;
+
+    const uint8_t *code = code_at(cpu, pc);
+    uint8_t opcode = code[0];
+    uint8_t length = opcode_lengths[opcode];
+    instructions++;
+
+    if (opcode == 0x20) {
+      // JR NZ, e8 is the loop branch of almost every hot block
+      uint16_t next = pc + length;
+      uint16_t target = next + (int8_t)code[1];
+      cycles += opcode_cycles[opcode];
+      emit_test_imm(&e, HOST_AF, 0x80);
+      size_t not_taken = emit_jcc(&e, CC_NE);
+      emit_exit(&e, target, (cycles + 4) >> shift);
+      patch_jump(&e, not_taken, e.size);
+      emit_exit(&e, next, cycles >> shift);
+      terminated = 1;
+      pc += length;
+      break;
+    }
+
+    uint32_t native_cycles = opcode_cycles[opcode];
+    if (opcode == 0xCB)
+      native_cycles += special_opcode_cycles[code[1]];
+    if (emit_native(&e, code)) {
+      cycles += native_cycles;
+      pc += length;
+      continue;
+    }
+
+    emit_handler_call(&e, jit, pc, opcode,
+                      (cycles + opcode_cycles[opcode]) >> shift,
+                      invalidated_exits, &exit_count);
+    cycles = 0;
+    pc += length;
+    if (opcode_flow[opcode] != FLOW_NONE) {
+      terminated = 1;
+      break;
+    }
+  }
+
+  if (!terminated)
+    emit_exit(&e, pc, cycles >> shift);
+
+  if (exit_count > 0) {
+    size_t bail = e.size;
+    emit_epilogue(&e);
+    for (size_t i = 0; i < exit_count; i++)
+      patch_jump(&e, invalidated_exits[i], bail);
+  }
+
+  Block *block = &jit->blocks[jit->block_count++];
+  block->code = (block_function)(void *)(jit->code + jit->code_used);
+  block->key = key;
+  block->start = start;
+  block->end = pc;
+  block->instructions = instructions;
+  jit->code_used += (e.size + 15) & ~(size_t)15;
+  jit->lookup[key] = block;
+  mark_pages(jit, block, 1);
+  return block;
+}
+
+JIT *jit_create(int verify) {
+  JIT *jit = calloc(1, sizeof(JIT));
+  if (jit == NULL)
+    return NULL;
+
+  // Two views of the same pages, one to run and one to emit into
+  int fd = memfd_create("gbemu-jit", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, JIT_CODE_SIZE) != 0) {
+    perror("Failed to create the JIT code cache.");
+    if (fd >= 0)
+      close(fd);
+    free(jit);
+    return NULL;
+  }
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd,
+                   0);
+  jit->code_write = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+  close(fd);
+  if (jit->code == MAP_FAILED || jit->code_write == MAP_FAILED) {
+    perror("Failed to map the JIT code cache.");
+    if (jit->code != MAP_FAILED)
+      munmap(jit->code, JIT_CODE_SIZE);
+    if (jit->code_write != MAP_FAILED)
+      munmap(jit->code_write, JIT_CODE_SIZE);
+    free(jit);
+    return NULL;
+  }
+
+  jit->single_step = verify;
+  jit->verify = verify;
+  if (verify) {
+    jit->shadow_memory = malloc(0x10000);
+    jit->shadow_wram_banks = malloc(WRAM_BANKS * WRAM_BANK_SIZE);
+    if (jit->shadow_memory == NULL || jit->shadow_wram_banks == NULL) {
+      jit_destroy(jit);
+      return NULL;
+    }
+  }
+  return jit;
+}
+
+void jit_destroy(JIT *jit) {
+  if (jit == NULL)
+    return;
+  munmap(jit->code, JIT_CODE_SIZE);
+  munmap(jit->code_write, JIT_CODE_SIZE);
+  free(jit->shadow_memory);
+  free(jit->shadow_wram_banks);
+  free(jit);
+}
+
+// Drop the block kept at key when it reaches into a range from start
+static void drop(JIT *jit, uint32_t key, uint16_t start) {
+  Block *block = jit->lookup[key];
+  if (block == NULL || block->end <= start)
+    return;
+  jit->lookup[key] = NULL;
+  jit->heat[key] = 0;
+  mark_pages(jit, block, -1);
+  if (block == jit->running)
+    jit->invalidated = 1;
+}
+
+void jit_invalidate(JIT *jit, uint16_t start, uint32_t end) {
+  // Speed switches, breakpoint changes and loaded states start over
+  if (start == 0 && end >= 0x10000) {
+    if (jit->running != NULL)
+      jit->invalidated = 1;
+    flush(jit);
+    return;
+  }
+
+  // Blocks are looked up by start address, the ones overlapping the range
+  // start at most MAX_BLOCK_BYTES in front of it. Their pages are counted
+  // in code_pages, without any there is nothing to look up.
+  int compiled = 0;
+  for (uint32_t page = start >> 8; page <= (end - 1) >> 8 && !compiled; page++)
+    compiled = jit->code_pages[page] != 0;
+  uint32_t first = start > MAX_BLOCK_BYTES ? start - MAX_BLOCK_BYTES : 0;
+  for (uint32_t address = first; address < end && compiled; address++) {
+    drop(jit, address, start);
+    // Breakpoints in the switchable ROM bank apply to every bank
+    if (address >= ROM_BANK_SIZE && address < 2 * ROM_BANK_SIZE)
+      for (uint32_t bank = 1; bank < JIT_ROM_BANKS; bank++)
+        drop(jit, 0x10000 + bank * ROM_BANK_SIZE + (address - ROM_BANK_SIZE),
+             start);
+  }
+  for (uint32_t address = start; address < end; address++)
+    if (jit->heat[address] == JIT_UNCOMPILABLE)
+      jit->heat[address] = 0;
+}
+
+static void report_divergence(CPU *jit_cpu, CPU *reference, uint16_t pc) {
+  fprintf(stderr, "JIT divergence after the instruction at %04X (%02X)\n", pc,
+          reference->memory[pc]);
+  fprintf(stderr, "  %-11s AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X "
+                  "IME=%u cycles=%" PRIu64 "\n",
+          "jit", jit_cpu->AF, jit_cpu->BC, jit_cpu->DE, jit_cpu->HL,
+          jit_cpu->SP, jit_cpu->PC, jit_cpu->ime, jit_cpu->cycles);
+  fprintf(stderr, "  %-11s AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X "
+                  "IME=%u cycles=%" PRIu64 "\n",
+          "interpreter", reference->AF, reference->BC, reference->DE,
+          reference->HL, reference->SP, reference->PC, reference->ime,
+          reference->cycles);
+  for (uint32_t address = 0; address < 0x10000; address++)
+    if (jit_cpu->memory[address] != reference->memory[address])
+      fprintf(stderr, "  memory[%04X] jit=%02X interpreter=%02X\n", address,
+              jit_cpu->memory[address], reference->memory[address]);
+  exit(EXIT_FAILURE);
+}
+
+// Run a single instruction block and the interpreter side by side. The
+// interpreter copy has no PPU or APU attached, verify headless runs only.
+static void verify_block(CPU *cpu, Block *block) {
+  JIT *jit = cpu->jit;
+  CPU reference = *cpu;
+  memcpy(jit->shadow_memory, cpu->memory, 0x10000);
+  reference.memory = jit->shadow_memory;
+  // Bank switches in the block must not swap the banks a second time
+  if (cpu->wram_banks != NULL) {
+    memcpy(jit->shadow_wram_banks, cpu->wram_banks,
+           WRAM_BANKS * WRAM_BANK_SIZE);
+    reference.wram_banks = (uint8_t(*)[WRAM_BANK_SIZE])jit->shadow_wram_banks;
+  }
+  reference.ppu = NULL;
+  reference.apu = NULL;
+  reference.serial_out = NULL;
+  reference.jit = NULL;
+
+  block->code(cpu);
+  for (int i = 0; i < block->instructions; i++)
+    step(&reference);
+
+  if (cpu->AF != reference.AF || cpu->BC != reference.BC ||
+      cpu->DE != reference.DE || cpu->HL != reference.HL ||
+      cpu->SP != reference.SP || cpu->PC != reference.PC ||
+      cpu->ime != reference.ime || cpu->cycles != reference.cycles ||
+      cpu->rom_bank != reference.rom_bank ||
+      memcmp(cpu->memory, reference.memory, 0x10000) != 0 ||
+      (cpu->wram_banks != NULL &&
+       memcmp(cpu->wram_banks, reference.wram_banks,
+              WRAM_BANKS * WRAM_BANK_SIZE) != 0))
+    report_divergence(cpu, &reference, block->start);
+}
+
+int jit_step(CPU *cpu) {
+  JIT *jit = cpu->jit;
+  uint16_t pc = cpu->PC;
+  uint32_t key = block_key(cpu, pc);
+  Block *block = jit->lookup[key];
+
+  if (block == NULL && jit->heat[key] != JIT_UNCOMPILABLE) {
+    int threshold =
+        jit->single_step || jit->eager ? 1 : JIT_HOT_THRESHOLD;
+    if (++jit->heat[key] >= threshold) {
+      block = compile(jit, cpu, key, pc);
+      if (block == NULL)
+        jit->heat[key] = JIT_UNCOMPILABLE;
+    }
+  }
+  if (block == NULL) {
+    step(cpu);
+    return 1;
+  }
+
+  jit->invalidated = 0;
+  jit->running = block;
+  if (jit->verify)
+    verify_block(cpu, block);
+  else
+    block->code(cpu);
+  jit->running = NULL;
+  return block->instructions;
+}
+
+#else
+
+JIT *jit_create(int verify) {
+  fprintf(stderr, "The JIT is only available on x86-64 Linux.\n");
+  return NULL;
+}
+
+void jit_destroy(JIT *jit) {}
+
+int jit_step(CPU *cpu) {
+  step(cpu);
+  return 1;
+}
+
+void jit_invalidate(JIT *jit, uint16_t start, uint32_t end) {}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef JIT_NEOSAHADEO
+#define JIT_NEOSAHADEO
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// Optional x86-64 recompiler for hot basic blocks. Anything it can not
+// translate, or does not consider hot yet, runs through the interpreter.
+
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_MAX_BLOCKS 16384
+#define JIT_MAX_INSTRUCTIONS 64
+#define JIT_HOT_THRESHOLD 16 // Entries through the interpreter before compiling
+
+// Blocks are keyed by address, those in the switchable ROM bank by bank
+// and address. ROM never changes, so a bank switch leaves them in place.
+#define JIT_ROM_BANKS 32 // All the MBC1 can select
+#define JIT_KEYS (0x10000 + JIT_ROM_BANKS * 0x4000)
+
+struct CPU;
+
+typedef void (*block_function)(struct CPU *cpu);
+
+typedef struct Block {
+  block_function code;
+  uint32_t key;
+  uint16_t start;
+  uint32_t end; // One past the last byte of the last instruction
+  uint16_t instructions;
+} Block;
+
+typedef struct JIT {
+  // The code cache is mapped twice, never writable and executable at
+  // once. Blocks are emitted through code_write and run from code, they
+  // are bump allocated.
+  uint8_t *code;
+  uint8_t *code_write;
+  size_t code_used;
+
+  Block blocks[JIT_MAX_BLOCKS];
+  size_t block_count;
+  Block *lookup[JIT_KEYS]; // NULL when not compiled
+  uint8_t heat[JIT_KEYS];
+
+  // Live blocks overlapping each 256 byte page. RAM writes into pages with
+  // blocks drop the ones covering the written byte.
+  uint16_t code_pages[256];
+  Block *running;      // Block being executed, NULL between blocks
+  uint8_t invalidated; // Set when the running block lost its code
+
+  // Compile every instruction as its own block on first entry, so engines
+  // can be compared after each one. Set by verify and the fuzzer.
+  int single_step;
+  // Compile on first entry instead of once hot, set by the fuzzer
+  int eager;
+
+  // Compare every block with the interpreter run on a copy of the machine
+  int verify;
+  uint8_t *shadow_memory;
+  uint8_t *shadow_wram_banks;
+} JIT;
+
+// NULL when the host is not x86-64 Linux or the code cache can't be mapped
+JIT *jit_create(int verify);
+void jit_destroy(JIT *jit);
+
+// Run one compiled block, or a single instruction through the interpreter.
+// Returns the number of guest instructions in what was run.
+int jit_step(struct CPU *cpu);
+void jit_invalidate(JIT *jit, uint16_t start, uint32_t end);
+
+#endif
@@ -1,82 +1,357 @@
+#include "apu.h"
+#include "audio.h"
 #include "cpu.h"
+#include "debugger.h"
+#include "export.h"
+#include "jit.h"
+#include "mmu.h"
+#include "pacing.h"
+#include "ppu.h"
+#include "runahead.h"
 #include "screen.h"
+#include "sram.h"
 #include "utils.h"
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-#define TARGET_FPS 60
+#define MAX_UNLIMITED_FRAMES 1000
 
-// printf("X=> %04x \n", cpu->AF);
-
-// Nanoseconds per frame
-#define FRAME_TIME_NS (1000000000 / TARGET_FPS)
+// Run several frames per host frame, only the last one is composed
+static void run_frames(CPU *cpu, int frames) {
+  for (int i = 0; i < frames; i++) {
+    cpu->ppu->render = i == frames - 1;
+    run_frame(cpu);
+  }
+}
 
-long long current_time_ns() {
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+// Hand the frame of the machine shown to the window and to readers of the
+// export, the sound comes from cpu
+static void present(CPU *cpu, const CPU *shown, Exporter *exporter) {
+  if (exporter != NULL)
+    export_publish(exporter, shown, cpu);
+  screen_present(shown->ppu->framebuffer);
 }
 
-void game_loop(CPU *cpu) {
-  long long last_time = current_time_ns();
-  long long accumulator = 0;
+// A multiplier of 0 fast-forwards as fast as possible
+void game_loop(CPU *cpu, Pacer *pacer, RunAhead *runahead, Exporter *exporter,
+               int multiplier, int fast_forward_lock) {
+  int fast_forward = 0;
+  int unlimited_frames = 1;
 
-  while (1) {
-    long long now = current_time_ns();
-    long long elapsed = now - last_time;
-    last_time = now;
+  // A fault outside the debugger ends the session
+  while (screen_poll() && !cpu->fault) {
+    // Hand what the game saved last frame to the kernel for writeback
+    sram_flush(cpu);
 
-    accumulator += elapsed;
+    int requested = fast_forward_lock || screen_fast_forward_held();
+    if (requested != fast_forward) {
+      fast_forward = requested;
+      apu_set_synthesis(cpu->apu, !fast_forward, cpu->cycles);
+      pacer_set_fast_forward(pacer, fast_forward, multiplier == 0);
+    }
+
+    int frames = 1;
+    if (fast_forward)
+      frames = multiplier > 0 ? multiplier : unlimited_frames;
 
-    // Run the update and render steps if enough time has passed
-    while (accumulator >= FRAME_TIME_NS) {
-      // Update game/emulator state here
-      step(cpu);
+    cpu->joypad = screen_joypad();
 
-      // Render frame here
+    // The window stops updating while the prompt waits for commands
+    if (cpu->debugger != NULL) {
+      cpu->ppu->render = 1;
+      while (cpu->debugger != NULL && debugger_run_frame(cpu) != DEBUG_RUNNING)
+        debugger_prompt(cpu, stdin, stdout);
+      if (cpu->debugger != NULL) {
+        present(cpu, cpu, exporter);
+        pacer_wait(pacer);
+        continue;
+      }
+    }
 
-      accumulator -= FRAME_TIME_NS;
+    // Run-ahead is pointless while fast-forwarding, the frames shown are
+    // already far apart
+    if (runahead != NULL && !fast_forward) {
+      uint64_t start = cpu->cycles;
+      cpu->ppu->render = 0;
+      run_frame(cpu);
+      present(cpu, runahead_frame(runahead, cpu, start), exporter);
+      // The worker runs the next frame's run-ahead while this thread waits
+      // for the host frame and polls input
+      runahead_speculate(runahead, cpu);
+      pacer_wait(pacer);
+      continue;
     }
 
-    // Calculate how much time is left in the frame and sleep
-    long long frame_end_time = last_time + FRAME_TIME_NS - accumulator;
-    long long sleep_time_ns = frame_end_time - current_time_ns();
+    long long start = current_time_ns();
+    run_frames(cpu, frames);
 
-    if (sleep_time_ns > 0) {
-      // usleep takes microseconds, so convert ns to us
-      usleep(sleep_time_ns / 1000);
+    // Size the next unlimited batch to fill one host frame
+    if (fast_forward && multiplier == 0) {
+      long long elapsed = current_time_ns() - start;
+      unlimited_frames = elapsed > 0 ? frames * FRAME_TIME_NS / elapsed : 1;
+      if (unlimited_frames < 1)
+        unlimited_frames = 1;
+      if (unlimited_frames > MAX_UNLIMITED_FRAMES)
+        unlimited_frames = MAX_UNLIMITED_FRAMES;
     }
+
+    present(cpu, cpu, exporter);
+    pacer_wait(pacer);
+  }
+}
+
+// game.gb saves to game.sav
+static void open_save_file(CPU *cpu, const char *rom_path) {
+  size_t length = strlen(rom_path);
+  const char *extension = strrchr(rom_path, '.');
+  if (extension != NULL && strchr(extension, '/') == NULL)
+    length = extension - rom_path;
+
+  char *path = malloc(length + sizeof(".sav"));
+  if (path == NULL) {
+    perror("Failed to allocate the save file path.");
+    exit(EXIT_FAILURE);
   }
+  memcpy(path, rom_path, length);
+  strcpy(path + length, ".sav");
+  sram_open(cpu, path);
+  free(path);
 }
 
-int main(void) {
+// "/name,C000-C0FF,FF80-FFFE" exports those ranges, all of WRAM when none
+// are given
+static Exporter *open_export(const char *argument) {
+  char *copy = strdup(argument);
+  if (copy == NULL) {
+    perror("Failed to allocate the export name.");
+    exit(EXIT_FAILURE);
+  }
+
+  char *name = strtok(copy, ",");
+  ExportRegion regions[EXPORT_MAX_REGIONS];
+  size_t count = 0;
+  for (char *range = strtok(NULL, ","); range != NULL;
+       range = strtok(NULL, ",")) {
+    unsigned int start, end;
+    if (count == EXPORT_MAX_REGIONS ||
+        sscanf(range, "%x-%x", &start, &end) != 2 || end < start ||
+        end > 0xFFFF || end - start + 1 > EXPORT_RAM_SIZE) {
+      fprintf(stderr, "Invalid exported range %s.\n", range);
+      free(copy);
+      return NULL;
+    }
+    regions[count++] = (ExportRegion){start, end - start + 1};
+  }
+  if (count == 0)
+    regions[count++] = (ExportRegion){0xC000, 0x2000};
+
+  Exporter *exporter = export_create(name, regions, count);
+  free(copy);
+  return exporter;
+}
+
+// Missing or empty boot ROM dumps fall back to fast boot
+static int boot_rom_available(const char *path) {
+  struct stat sb;
+  return stat(path, &sb) == 0 && sb.st_size > 0;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-s audio|video] [-v sleep|vsync|uncapped] [-f n] [-F] [-j] "
+          "[-r n] [-d] [-x name[,range...]] [-b] [rom]\n"
+          "  -s  master clock, audio uses dynamic rate control (default)\n"
+          "  -v  video pacing when the master clock is video (default sleep)\n"
+          "  -f  fast-forward multiplier while Tab is held, 0 is unlimited\n"
+          "  -F  always fast-forward\n"
+          "  -j  run hot code through the x86-64 JIT\n"
+          "  -r  show frames this many frames ahead to hide input lag (max %d)\n"
+          "  -d  start paused in the debugger, commands are read from stdin\n"
+          "  -x  publish frames to POSIX shared memory, ranges like C000-C0FF\n"
+          "  -b  skip the boot ROM, start the cartridge in the post-boot state\n"
+          "  rom cartridge, battery RAM is kept in a .sav file next to it\n",
+          program, MAX_RUNAHEAD_FRAMES);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  int audio_sync = 1;
+  VideoPacing video = VIDEO_PACING_SLEEP;
+  int multiplier = 4;
+  int fast_forward_lock = 0;
+  int use_jit = 0;
+  int runahead_frames = 0;
+  int debug = 0;
+  const char *export_argument = NULL;
+  int fast_boot = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:v:f:Fjr:dx:b")) != -1) {
+    switch (opt) {
+    case 's':
+      if (strcmp(optarg, "audio") == 0)
+        audio_sync = 1;
+      else if (strcmp(optarg, "video") == 0)
+        audio_sync = 0;
+      else
+        usage(argv[0]);
+      break;
+    case 'v':
+      if (strcmp(optarg, "sleep") == 0)
+        video = VIDEO_PACING_SLEEP;
+      else if (strcmp(optarg, "vsync") == 0)
+        video = VIDEO_PACING_VSYNC;
+      else if (strcmp(optarg, "uncapped") == 0)
+        video = VIDEO_PACING_UNCAPPED;
+      else
+        usage(argv[0]);
+      break;
+    case 'f':
+      multiplier = strtol(optarg, NULL, 10);
+      if (multiplier < 0)
+        usage(argv[0]);
+      break;
+    case 'F':
+      fast_forward_lock = 1;
+      break;
+    case 'j':
+      use_jit = 1;
+      break;
+    case 'd':
+      debug = 1;
+      break;
+    case 'x':
+      export_argument = optarg;
+      break;
+    case 'b':
+      fast_boot = 1;
+      break;
+    case 'r':
+      runahead_frames = strtol(optarg, NULL, 10);
+      if (runahead_frames < 0 || runahead_frames > MAX_RUNAHEAD_FRAMES)
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
   CPU cpu;
   const char *filename = "./roms/dmg_boot.bin";
   size_t file_size = 0;
 
   uint8_t *memory = calloc(65536, sizeof(uint8_t)); // 64KiB
-  uint8_t *vram = calloc(8192, sizeof(uint8_t)); // 8 KiB VRAM (0x8000 - 0x9FFF)
+
+  PPU *ppu = malloc(sizeof(PPU));
+  if (ppu == NULL) {
+    perror("Failed to allocate memory for the ppu.");
+    exit(EXIT_FAILURE);
+  }
+
+  APU *apu = malloc(sizeof(APU));
+  if (apu == NULL) {
+    perror("Failed to allocate memory for the apu.");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t *framebuffer = malloc(LCD_WIDTH * LCD_HEIGHT * sizeof(uint32_t));
+  AudioBuffers *audio_buffers = malloc(sizeof(AudioBuffers));
+  if (framebuffer == NULL || audio_buffers == NULL) {
+    perror("Failed to allocate the framebuffer and audio buffers.");
+    exit(EXIT_FAILURE);
+  }
 
   initialize_cpu(&cpu, memory);
-  read_to_buffer(filename, &cpu.memory, &file_size);
+  ppu_init(ppu, memory, framebuffer);
+  apu_init(apu, memory + 0xFF10, audio_buffers);
+  cpu.ppu = ppu;
+  ppu->bus = &cpu;
+  cpu.apu = apu;
+
+  // The boot ROM covers the cartridge header until it unmaps itself
+  if (optind < argc) {
+    uint8_t *rom = NULL;
+    size_t rom_size = 0;
+    read_to_buffer(argv[optind], &rom, &rom_size);
+    load_cartridge(&cpu, rom, rom_size);
+    open_save_file(&cpu, argv[optind]);
+    if (cpu.cgb)
+      filename = "./roms/cgb_boot.bin";
+    if (!fast_boot && !boot_rom_available(filename)) {
+      fprintf(stderr, "No boot ROM at %s, using fast boot.\n", filename);
+      fast_boot = 1;
+    }
+  } else {
+    // Without a cartridge only the boot ROM has anything to run
+    fast_boot = 0;
+  }
+
+  if (fast_boot) {
+    post_boot_state(&cpu);
+  } else {
+    read_to_buffer(filename, &cpu.memory, &file_size);
+
+    // The CGB boot ROM leaves a hole for the header it reads the logo from
+    if (cpu.cgb && cpu.rom_size >= 0x200)
+      memcpy(cpu.memory + 0x100, cpu.rom + 0x100, 0x100);
 
-  printf("\n");
-  printf("BOOT ROM: \n");
-  for (size_t i = 0; i < file_size; i++) {
-    printf("%02x ", cpu.memory[i]);
+    printf("\n");
+    printf("BOOT ROM: \n");
+    for (size_t i = 0; i < file_size; i++) {
+      printf("%02x ", cpu.memory[i]);
 
-    if ((i + 1) % 16 == 0)
-      printf("\n");
+      if ((i + 1) % 16 == 0)
+        printf("\n");
+    }
+    printf("\n");
   }
-  printf("\n");
 
-  game_loop(&cpu);
+  // Keep interpreting when the JIT is not available on this host
+  if (use_jit)
+    cpu.jit = jit_create(0);
+
+  if (debug && debugger_attach(&cpu) != NULL)
+    cpu.debugger->pause = 1;
+
+  // Sound and video are optional, keep emulating without them. Losing the
+  // device that was meant to pace frames falls back to sleeping.
+  if (audio_open(apu) != 0)
+    audio_sync = 0;
+  if (screen_open(video == VIDEO_PACING_VSYNC) != 0 &&
+      video == VIDEO_PACING_VSYNC)
+    video = VIDEO_PACING_SLEEP;
+
+  // Without the worker every frame is simply shown as it is emulated
+  RunAhead *runahead = NULL;
+  if (runahead_frames > 0)
+    runahead = runahead_create(&cpu, runahead_frames);
+
+  // Emulation goes on when nobody can read the frames
+  Exporter *exporter = NULL;
+  if (export_argument != NULL)
+    exporter = open_export(export_argument);
+
+  Pacer pacer;
+  pacer_init(&pacer, audio_sync ? apu : NULL, video);
+  game_loop(&cpu, &pacer, runahead, exporter, multiplier, fast_forward_lock);
+  if (cpu.fault)
+    printf("Instruction not implemented: %02x\n\n", mmu_read(&cpu, cpu.PC - 1));
+
+  runahead_destroy(runahead);
+  sram_close(&cpu);
+  debugger_detach(&cpu);
+  export_destroy(exporter);
+
+  screen_close();
+  audio_close();
+  jit_destroy(cpu.jit);
 
-  return 0;
+  return cpu.fault ? EXIT_FAILURE : 0;
 }
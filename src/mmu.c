@@ -1,6 +1,267 @@
+#include "mmu.h"
+#include "apu.h"
+#include "cpu.h"
+#include "debugger.h"
+#include "jit.h"
+#include "ppu.h"
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-uint8_t mmu_read(uint16_t address) {
-  if (address <) {
+#define REG_P1 0xFF00   // Joypad
+#define REG_SB 0xFF01   // Serial transfer data
+#define REG_SC 0xFF02   // Serial transfer control
+#define REG_IF 0xFF0F   // Interrupt flag
+#define REG_NR52 0xFF26 // Sound on/off and channel status
+#define REG_STAT 0xFF41 // LCD status
+#define REG_LY 0xFF44   // LCD Y coordinate
+#define REG_DMA 0xFF46  // OAM DMA source
+#define REG_KEY1 0xFF4D // Speed switch
+#define REG_VBK 0xFF4F  // VRAM bank
+#define REG_BOOT 0xFF50 // Boot ROM disable
+#define REG_HDMA5 0xFF55 // VRAM DMA length, mode and start
+#define REG_BCPS 0xFF68 // Background palette index
+#define REG_BCPD 0xFF69 // Background palette data
+#define REG_OCPS 0xFF6A // Object palette index
+#define REG_OCPD 0xFF6B // Object palette data
+#define REG_SVBK 0xFF70 // WRAM bank
+
+#define HEADER_CGB 0x143
+#define CGB_BOOT_SIZE 0x900 // Boot ROM, around the cartridge header
+
+#define INT_SERIAL 0x08
+
+// Point 0x4000 - 0x7FFF at the selected bank. Nothing is copied or
+// remapped, instances sharing a cartridge keep reading the same pages, and
+// the JIT keeps the blocks of every bank.
+static void map_rom_bank(CPU *cpu) {
+  size_t banks = cpu->rom_size / ROM_BANK_SIZE;
+  if (banks < 2)
+    return;
+
+  cpu->rom_window = cpu->rom + (cpu->rom_bank % banks) * ROM_BANK_SIZE;
+}
+
+// Select the WRAM bank at 0xD000 - 0xDFFF. Bank 1 stays in the memory
+// map, the bus reads and writes the others in wram_banks, so nothing is
+// copied.
+static void map_wram_bank(CPU *cpu, uint8_t bank) {
+  if (bank == 0)
+    bank = 1;
+  if (bank != cpu->wram_bank) {
+    cpu->wram_bank = bank;
+    if (cpu->jit != NULL)
+      jit_invalidate(cpu->jit, 0xD000, 0xE000);
+  }
+  cpu->memory[REG_SVBK] = 0xF8 | bank;
+}
+
+void load_cartridge(CPU *cpu, uint8_t *rom, size_t size) {
+  cpu->rom = rom;
+  cpu->rom_size = size;
+  cpu->rom_bank = 1;
+
+  // Bit 7 of the CGB flag marks cartridges with color support
+  cpu->cgb = size > HEADER_CGB && (rom[HEADER_CGB] & 0x80);
+  if (cpu->cgb) {
+    if (cpu->wram_banks == NULL)
+      cpu->wram_banks = malloc(WRAM_BANKS * WRAM_BANK_SIZE);
+    if (cpu->wram_banks == NULL) {
+      perror("Failed to allocate the WRAM banks.");
+      exit(EXIT_FAILURE);
+    }
+    memset(cpu->wram_banks, 0, WRAM_BANKS * WRAM_BANK_SIZE);
+    cpu->wram_bank = 1;
+    cpu->memory[REG_SVBK] = 0xF9;
+  }
+  if (cpu->ppu != NULL)
+    cpu->ppu->cgb = cpu->cgb;
+
+  // Without banking the whole cartridge fits the memory map
+  size_t mapped = size < 2 * ROM_BANK_SIZE ? size : 2 * ROM_BANK_SIZE;
+  memcpy(cpu->memory, rom, mapped);
+  cpu->rom_window = NULL;
+  map_rom_bank(cpu);
+}
+
+// Offset of an 0xA000 - 0xBFFF address in the save file
+static size_t sram_offset(CPU *cpu, uint16_t address) {
+  size_t offset = (size_t)cpu->sram_bank * SRAM_BANK_SIZE + (address - 0xA000);
+  return offset % cpu->sram_size;
+}
+
+uint8_t mmu_read(CPU *cpu, uint16_t address) {
+  if (cpu->watch_pages != NULL && (cpu->watch_pages[address >> 8] & WATCH_READ))
+    debugger_access(cpu, address, 0, WATCH_READ);
+
+  if (cpu->rom_window != NULL && (address & 0xC000) == ROM_BANK_SIZE)
+    return cpu->rom_window[address - ROM_BANK_SIZE];
+
+  if ((address & 0xF000) == 0xD000 && cpu->wram_bank > 1)
+    return cpu->wram_banks[cpu->wram_bank][address - 0xD000];
+
+  // VRAM bank 1 is kept in the PPU
+  if ((address & 0xE000) == 0x8000 && cpu->ppu != NULL && cpu->ppu->vram_bank)
+    return cpu->ppu->vram1[address - 0x8000];
+
+  // Disabled cartridge RAM floats high
+  if (cpu->sram != NULL && (address & 0xE000) == 0xA000)
+    return cpu->sram_enabled ? cpu->sram[sram_offset(cpu, address)] : 0xFF;
+
+  // Registers updated by the PPU and APU are only current once they have
+  // caught up with the CPU
+  switch (address) {
+  case REG_P1: {
+    // Bits 4 and 5 select the rows, pressed buttons read as 0
+    uint8_t select = cpu->memory[REG_P1];
+    uint8_t pressed = 0;
+    if (!(select & 0x10))
+      pressed |= cpu->joypad & 0x0F;
+    if (!(select & 0x20))
+      pressed |= cpu->joypad >> 4;
+    return 0xC0 | (select & 0x30) | (~pressed & 0x0F);
+  }
+  case REG_IF:
+  case REG_STAT:
+  case REG_LY:
+    if (cpu->ppu != NULL)
+      ppu_run_to(cpu->ppu, cpu->cycles);
+    break;
+  case REG_NR52:
+    if (cpu->apu != NULL)
+      apu_run_to(cpu->apu, cpu->cycles);
+    break;
+  case REG_KEY1:
+    if (cpu->cgb)
+      return cpu->speed_shift << 7 | 0x7E | (cpu->memory[REG_KEY1] & 0x01);
+    break;
+  case REG_HDMA5:
+  case REG_BCPD:
+  case REG_OCPD:
+    if (cpu->cgb && cpu->ppu != NULL)
+      return ppu_read(cpu->ppu, cpu->cycles, address);
+    break;
+  }
+  return cpu->memory[address];
+}
+
+void mmu_write(CPU *cpu, uint16_t address, uint8_t value) {
+  if (cpu->watch_pages != NULL &&
+      (cpu->watch_pages[address >> 8] & WATCH_WRITE))
+    debugger_access(cpu, address, value, WATCH_WRITE);
+
+  // H-blank DMA blocks are copied when the PPU catches up. The ones due
+  // before this write must not see what it changes: their source bytes, or
+  // the ROM, cartridge RAM or WRAM bank they are read from.
+  if (cpu->ppu != NULL && cpu->ppu->hdma_active &&
+      (address < 0x8000 || address == REG_SVBK ||
+       ppu_hdma_source(cpu->ppu, address)))
+    ppu_run_to(cpu->ppu, cpu->cycles);
+
+  if (address < 0x8000) {
+    // ROM is read only, writes go to the MBC1 registers
+    if (address < 0x2000) {
+      cpu->sram_enabled = (value & 0x0F) == 0x0A;
+    } else if (address < 0x4000) {
+      uint16_t bank = value & 0x1F;
+      if (bank == 0)
+        bank = 1;
+      if (bank != cpu->rom_bank) {
+        cpu->rom_bank = bank;
+        map_rom_bank(cpu);
+      }
+    } else if (address < 0x6000) {
+      // Always taken as the RAM bank, ROMs large enough to need them as
+      // upper ROM bank bits are not supported
+      cpu->sram_bank = value & 0x03;
+    }
+    return;
+  }
+
+  if (cpu->sram != NULL && (address & 0xE000) == 0xA000) {
+    if (cpu->sram_enabled) {
+      cpu->sram[sram_offset(cpu, address)] = value;
+      cpu->sram_dirty = 1;
+    }
+    return;
+  }
+
+  // Self modifying code, drop compiled blocks the write lands in
+  if (cpu->jit != NULL && cpu->jit->code_pages[address >> 8])
+    jit_invalidate(cpu->jit, address, address + 1);
+
+  if ((address & 0xF000) == 0xD000 && cpu->wram_bank > 1) {
+    cpu->wram_banks[cpu->wram_bank][address - 0xD000] = value;
+    return;
+  }
+
+  // Sound registers and wave RAM
+  if (address >= 0xFF10 && address < 0xFF40 && cpu->apu != NULL) {
+    apu_write(cpu->apu, cpu->cycles, address, value);
+    return;
+  }
+
+  // VRAM, OAM and LCD registers, the PPU catches up before they change
+  if (cpu->ppu != NULL &&
+      ((address < 0xA000) || (address >= 0xFE00 && address < 0xFEA0) ||
+       (address >= 0xFF40 && address < 0xFF4C && address != REG_DMA) ||
+       (cpu->cgb && (address == REG_VBK ||
+                     (address >= REG_BCPS && address <= REG_OCPD))))) {
+    ppu_write(cpu->ppu, cpu->cycles, address, value);
+    return;
+  }
+
+  switch (address) {
+  case REG_P1:
+    cpu->memory[address] = value & 0x30;
+    break;
+  case REG_SC:
+    // Transfers with the internal clock complete immediately, there is no
+    // link partner so the received byte is always 0xFF
+    if ((value & 0x81) == 0x81) {
+      if (cpu->serial_out != NULL)
+        cpu->serial_out(cpu, cpu->memory[REG_SB]);
+      cpu->memory[REG_SB] = 0xFF;
+      cpu->memory[REG_IF] |= INT_SERIAL;
+      value &= 0x7F;
+    }
+    cpu->memory[address] = value;
+    break;
+  case REG_DMA:
+    // Copy the whole sprite table at once. The source is read like the CPU
+    // would, from the banked ROM, cartridge RAM or VRAM bank it sees.
+    if (cpu->ppu != NULL)
+      ppu_run_to(cpu->ppu, cpu->cycles);
+    for (uint16_t i = 0; i < 0xA0; i++)
+      cpu->memory[0xFE00 + i] = mmu_read(cpu, (value << 8) + i);
+    cpu->memory[address] = value;
+    break;
+  case REG_KEY1:
+    // Armed here, the switch happens on the next STOP
+    cpu->memory[address] = value & 0x01;
+    break;
+  case REG_HDMA5:
+    if (cpu->cgb && cpu->ppu != NULL)
+      cpu->cycles += ppu_start_hdma(cpu->ppu, cpu->cycles, value);
+    break;
+  case REG_SVBK:
+    if (cpu->cgb)
+      map_wram_bank(cpu, value & 0x07);
+    break;
+  case REG_BOOT:
+    // Unmap the boot ROM by restoring the cartridge underneath, the CGB
+    // one also covers 0x200 - 0x8FF
+    if (value != 0 && cpu->rom != NULL) {
+      size_t size = cpu->cgb ? CGB_BOOT_SIZE : 0x100;
+      memcpy(cpu->memory, cpu->rom, cpu->rom_size < size ? cpu->rom_size : size);
+      if (cpu->jit != NULL)
+        jit_invalidate(cpu->jit, 0x0000, size);
+    }
+    cpu->memory[address] = value;
+    break;
+  default:
+    cpu->memory[address] = value;
+    break;
   }
 }
@@ -0,0 +1,15 @@
+#ifndef MMU_NEOSAHADEO
+#define MMU_NEOSAHADEO
+
+#include "cpu.h"
+#include <inttypes.h>
+
+#define ROM_BANK_SIZE 0x4000
+#define SRAM_BANK_SIZE 0x2000
+#define SRAM_MAX_SIZE (4 * SRAM_BANK_SIZE) // All the RAM MBC1 can bank
+
+uint8_t mmu_read(CPU *cpu, uint16_t address);
+void mmu_write(CPU *cpu, uint16_t address, uint8_t value);
+void load_cartridge(CPU *cpu, uint8_t *rom, size_t size);
+
+#endif
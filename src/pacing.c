@@ -0,0 +1,110 @@
+#include "pacing.h"
+#include "apu.h"
+#include "cpu.h"
+#include "utils.h"
+#include <time.h>
+
+#define SPIN_NS 200000     // Final stretch before a deadline is spun, not slept
+#define MAX_LAG_FRAMES 4   // Resync instead of bursting to catch up
+#define AUDIO_POLL_NS 500000
+
+// Keep half the ring queued, the rate is nudged by at most +-0.5% to hold
+// it there which is well below audible pitch change
+#define AUDIO_TARGET_FRAMES (AUDIO_RING_FRAMES / 2)
+#define DRC_MAX_DELTA 0.005
+#define FILL_SMOOTHING 0.1
+
+static void sleep_ns(long long duration) {
+  struct timespec ts;
+  ts.tv_sec = duration / 1000000000LL;
+  ts.tv_nsec = duration % 1000000000LL;
+  nanosleep(&ts, NULL);
+}
+
+// Sleeping on an absolute deadline keeps errors from accumulating frame to
+// frame, the last SPIN_NS are spun to avoid scheduler oversleep
+static void sleep_until(long long deadline) {
+  long long wake = deadline - SPIN_NS;
+  if (wake > current_time_ns()) {
+    struct timespec ts;
+    ts.tv_sec = wake / 1000000000LL;
+    ts.tv_nsec = wake % 1000000000LL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+  while (current_time_ns() < deadline)
+    ;
+}
+
+void pacer_init(Pacer *pacer, APU *apu, VideoPacing video) {
+  pacer->apu = apu;
+  pacer->video = video;
+  pacer->deadline_ns = current_time_ns();
+  pacer->average_fill = AUDIO_TARGET_FRAMES;
+  pacer->fast_forward = 0;
+  pacer->unlimited = 0;
+}
+
+void pacer_set_fast_forward(Pacer *pacer, int enabled, int unlimited) {
+  pacer->fast_forward = enabled;
+  pacer->unlimited = unlimited;
+  pacer->deadline_ns = current_time_ns();
+  pacer->average_fill = AUDIO_TARGET_FRAMES;
+}
+
+// Dynamic rate control: the fill level of the audio ring is the master clock.
+// Running low produces slightly more samples per emulated cycle, running high
+// slightly fewer, so the ring converges on the target without underruns.
+static void wait_audio(Pacer *pacer) {
+  APU *apu = pacer->apu;
+
+  pacer->average_fill += FILL_SMOOTHING *
+                         ((double)apu_buffered_frames(apu) - pacer->average_fill);
+  double deviation =
+      (AUDIO_TARGET_FRAMES - pacer->average_fill) / AUDIO_TARGET_FRAMES;
+  if (deviation > 1)
+    deviation = 1;
+  if (deviation < -1)
+    deviation = -1;
+  apu_set_rate(apu, 1.0 + DRC_MAX_DELTA * deviation);
+
+  // Block while more than the target latency is queued. Bounded so a
+  // stalled audio device degrades to free running instead of hanging.
+  long long give_up = current_time_ns() + 2 * FRAME_TIME_NS;
+  while (apu_buffered_frames(apu) > AUDIO_TARGET_FRAMES &&
+         current_time_ns() < give_up)
+    sleep_ns(AUDIO_POLL_NS);
+}
+
+static void wait_video(Pacer *pacer) {
+  pacer->deadline_ns += FRAME_TIME_NS;
+
+  long long now = current_time_ns();
+  if (now - pacer->deadline_ns > MAX_LAG_FRAMES * FRAME_TIME_NS) {
+    pacer->deadline_ns = now;
+    return;
+  }
+  sleep_until(pacer->deadline_ns);
+}
+
+// Called once per emulated frame, after it has been presented
+void pacer_wait(Pacer *pacer) {
+  if (pacer->fast_forward) {
+    if (!pacer->unlimited && pacer->video == VIDEO_PACING_SLEEP)
+      wait_video(pacer);
+    return;
+  }
+
+  if (pacer->apu != NULL) {
+    wait_audio(pacer);
+    return;
+  }
+
+  switch (pacer->video) {
+  case VIDEO_PACING_SLEEP:
+    wait_video(pacer);
+    break;
+  case VIDEO_PACING_VSYNC:
+  case VIDEO_PACING_UNCAPPED:
+    break;
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef PACING_NEOSAHADEO
+#define PACING_NEOSAHADEO
+
+#include "apu.h"
+#include "cpu.h"
+
+// One DMG frame, 59.73 Hz
+#define FRAME_TIME_NS (CYCLES_PER_FRAME * 1000000000LL / CPU_CLOCK_HZ)
+
+typedef enum {
+  VIDEO_PACING_SLEEP,    // Sleep to an absolute per-frame deadline
+  VIDEO_PACING_VSYNC,    // The blocking present paces frames
+  VIDEO_PACING_UNCAPPED, // Run as fast as possible
+} VideoPacing;
+
+typedef struct Pacer {
+  APU *apu; // Audio clock used as the master clock, NULL to pace on video
+  VideoPacing video;
+  long long deadline_ns;
+  double average_fill; // Smoothed ring fill level in frames
+
+  // While fast-forwarding no audio is synthesized, so host frames are paced
+  // by the video policy instead, or not at all when unlimited
+  int fast_forward;
+  int unlimited;
+} Pacer;
+
+void pacer_init(Pacer *pacer, APU *apu, VideoPacing video);
+void pacer_wait(Pacer *pacer);
+void pacer_set_fast_forward(Pacer *pacer, int enabled, int unlimited);
+
+#endif
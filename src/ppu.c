@@ -0,0 +1,579 @@
+#include "ppu.h"
+#include "mmu.h"
+#include <stdint.h>
+#include <string.h>
+
+#define REG_IF 0xFF0F
+#define REG_LCDC 0xFF40
+#define REG_STAT 0xFF41
+#define REG_SCY 0xFF42
+#define REG_SCX 0xFF43
+#define REG_LY 0xFF44
+#define REG_LYC 0xFF45
+#define REG_BGP 0xFF47
+#define REG_OBP0 0xFF48
+#define REG_OBP1 0xFF49
+#define REG_WY 0xFF4A
+#define REG_WX 0xFF4B
+#define REG_VBK 0xFF4F   // VRAM bank
+#define REG_HDMA1 0xFF51 // DMA source, high
+#define REG_HDMA2 0xFF52 // DMA source, low
+#define REG_HDMA3 0xFF53 // DMA destination, high
+#define REG_HDMA4 0xFF54 // DMA destination, low
+#define REG_HDMA5 0xFF55 // DMA length, mode and start
+#define REG_BCPS 0xFF68  // Background palette index
+#define REG_BCPD 0xFF69  // Background palette data
+#define REG_OCPS 0xFF6A  // Object palette index
+#define REG_OCPD 0xFF6B  // Object palette data
+
+#define OAM 0xFE00
+
+#define INT_VBLANK 0x01
+#define INT_STAT 0x02
+
+#define HDMA_BLOCK 16
+#define HDMA_BLOCK_CYCLES 32 // CPU stall per block
+
+#define LINE_CYCLES 456
+#define OAM_CYCLES 80
+#define MODE3_CYCLES 172
+#define SPRITE_PENALTY 6 // Approximate extra mode 3 cycles per sprite
+#define VBLANK_LINE 144
+#define LINES 154
+
+enum { MODE_HBLANK, MODE_VBLANK, MODE_OAM, MODE_TRANSFER };
+
+static const uint32_t shades[4] = {0xFFFFFFFF, 0xAAAAAAFF, 0x555555FF,
+                                   0x000000FF};
+
+// Every RGB555 color as 0xRRGGBBAA, shared by all PPUs
+static uint32_t rgb555[0x8000];
+static int rgb555_ready;
+
+static void init_rgb555(void) {
+  for (uint32_t color = 0; color < 0x8000; color++) {
+    uint32_t r = color & 0x1F;
+    uint32_t g = (color >> 5) & 0x1F;
+    uint32_t b = (color >> 10) & 0x1F;
+    r = r << 3 | r >> 2;
+    g = g << 3 | g >> 2;
+    b = b << 3 | b >> 2;
+    rgb555[color] = r << 24 | g << 16 | b << 8 | 0xFF;
+  }
+  rgb555_ready = 1;
+}
+
+// Where the rows of the frame being rendered go
+static uint32_t *frame(PPU *ppu) {
+  return ppu->target != NULL ? ppu->target : ppu->framebuffer;
+}
+
+// What the LCD shows while it is off
+static void blank(uint32_t *pixels) {
+  for (int i = 0; i < LCD_WIDTH * LCD_HEIGHT; i++)
+    pixels[i] = shades[0];
+}
+
+// VRAM of either bank, switching banks only changes which one the CPU sees
+static uint8_t *vram(PPU *ppu, uint8_t bank) {
+  return bank ? ppu->vram1 : ppu->memory + 0x8000;
+}
+
+// DMA reads its source wherever the CPU would, banked ROM and cartridge RAM
+// are not in memory. Echo RAM and above would catch the PPU up while it is
+// running, hardware can't copy from there anyway.
+static uint8_t dma_read(PPU *ppu, uint16_t address) {
+  if (ppu->bus != NULL && address < 0xE000)
+    return mmu_read(ppu->bus, address);
+  return ppu->memory[address];
+}
+
+static void set_mode(PPU *ppu, uint8_t mode) {
+  ppu->memory[REG_STAT] = (ppu->memory[REG_STAT] & 0xFC) | mode;
+}
+
+// Refresh the coincidence flag and raise the STAT interrupt on a rising
+// edge of any enabled source
+static void update_stat(PPU *ppu) {
+  uint8_t *memory = ppu->memory;
+  uint8_t stat = memory[REG_STAT];
+  uint8_t mode = stat & 0x03;
+  uint8_t coincidence = memory[REG_LY] == memory[REG_LYC];
+
+  stat = (stat & 0xFB) | coincidence << 2 | 0x80;
+  memory[REG_STAT] = stat;
+
+  uint8_t line = (stat & 0x08 && mode == MODE_HBLANK) ||
+                 (stat & 0x10 && mode == MODE_VBLANK) ||
+                 (stat & 0x20 && mode == MODE_OAM) ||
+                 (stat & 0x40 && coincidence);
+  if (line && !ppu->stat_line)
+    memory[REG_IF] |= INT_STAT;
+  ppu->stat_line = line;
+}
+
+// Select up to ten sprites on the current line. This runs for every frame,
+// rendered or not, since the sprite count stretches mode 3.
+static void scan_oam(PPU *ppu) {
+  uint8_t *memory = ppu->memory;
+  uint8_t ly = memory[REG_LY];
+  uint8_t height = memory[REG_LCDC] & 0x04 ? 16 : 8;
+
+  ppu->sprite_count = 0;
+  for (int i = 0; i < 40 && ppu->sprite_count < MAX_LINE_SPRITES; i++) {
+    int y = memory[OAM + i * 4] - 16;
+    if (ly >= y && ly < y + height)
+      ppu->sprites[ppu->sprite_count++] = i;
+  }
+
+  ppu->mode3_length = MODE3_CYCLES;
+  if (memory[REG_LCDC] & 0x02)
+    ppu->mode3_length += ppu->sprite_count * SPRITE_PENALTY;
+}
+
+static void start_line(PPU *ppu) {
+  uint8_t ly = ppu->memory[REG_LY];
+  if (ly == 0) {
+    ppu->window_line = 0;
+    ppu->composing = ppu->render;
+  }
+
+  if (ly < VBLANK_LINE) {
+    set_mode(ppu, MODE_OAM);
+    scan_oam(ppu);
+  } else if (ly == VBLANK_LINE) {
+    set_mode(ppu, MODE_VBLANK);
+    ppu->memory[REG_IF] |= INT_VBLANK;
+  }
+}
+
+static uint8_t tile_pixel(uint8_t *memory, uint16_t address, uint8_t x) {
+  uint8_t low = memory[address];
+  uint8_t high = memory[address + 1];
+  uint8_t bit = 7 - x;
+  return ((high >> bit) & 1) << 1 | ((low >> bit) & 1);
+}
+
+static uint16_t tile_address(uint8_t lcdc, uint8_t tile) {
+  if (lcdc & 0x10)
+    return 0x8000 + tile * 16;
+  return 0x9000 + (int8_t)tile * 16;
+}
+
+static int window_visible(PPU *ppu) {
+  uint8_t *memory = ppu->memory;
+  uint8_t lcdc = memory[REG_LCDC];
+  return (lcdc & 0x21) == 0x21 && memory[REG_WY] <= memory[REG_LY] &&
+         memory[REG_WX] < LCD_WIDTH + 7;
+}
+
+static void draw_sprites(PPU *ppu, uint32_t *row, const uint8_t *indices) {
+  uint8_t *memory = ppu->memory;
+  uint8_t ly = memory[REG_LY];
+  uint8_t height = memory[REG_LCDC] & 0x04 ? 16 : 8;
+
+  // Lower X wins, ties go to the lower OAM index
+  uint8_t order[MAX_LINE_SPRITES];
+  for (int i = 0; i < ppu->sprite_count; i++) {
+    int j = i;
+    while (j > 0 && memory[OAM + order[j - 1] * 4 + 1] >
+                        memory[OAM + ppu->sprites[i] * 4 + 1]) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = ppu->sprites[i];
+  }
+
+  // Draw lowest priority first so higher priority sprites end up on top
+  for (int i = ppu->sprite_count - 1; i >= 0; i--) {
+    uint8_t *sprite = &memory[OAM + order[i] * 4];
+    int x = sprite[1] - 8;
+    uint8_t tile = sprite[2];
+    uint8_t flags = sprite[3];
+
+    uint8_t line = ly - (sprite[0] - 16);
+    if (flags & 0x40)
+      line = height - 1 - line;
+    if (height == 16)
+      tile &= 0xFE;
+
+    uint16_t address = 0x8000 + tile * 16 + line * 2;
+    uint8_t palette = memory[flags & 0x10 ? REG_OBP1 : REG_OBP0];
+    for (int px = 0; px < 8; px++) {
+      int screen_x = x + px;
+      if (screen_x < 0 || screen_x >= LCD_WIDTH)
+        continue;
+
+      uint8_t color = tile_pixel(memory, address, flags & 0x20 ? 7 - px : px);
+      if (color == 0 || (flags & 0x80 && indices[screen_x] != 0))
+        continue;
+      row[screen_x] = shades[(palette >> (color * 2)) & 0x03];
+    }
+  }
+}
+
+static void draw_line(PPU *ppu) {
+  uint8_t *memory = ppu->memory;
+  uint8_t ly = memory[REG_LY];
+  uint8_t lcdc = memory[REG_LCDC];
+  uint8_t indices[LCD_WIDTH];
+  memset(indices, 0, sizeof(indices));
+
+  if (lcdc & 0x01) {
+    uint16_t map = lcdc & 0x08 ? 0x9C00 : 0x9800;
+    uint8_t y = ly + memory[REG_SCY];
+    uint8_t scx = memory[REG_SCX];
+    for (int x = 0; x < LCD_WIDTH; x++) {
+      uint8_t bx = x + scx;
+      uint8_t tile = memory[map + (y / 8) * 32 + bx / 8];
+      indices[x] = tile_pixel(memory, tile_address(lcdc, tile) + (y & 7) * 2,
+                              bx & 7);
+    }
+
+    if (window_visible(ppu)) {
+      uint16_t window_map = lcdc & 0x40 ? 0x9C00 : 0x9800;
+      uint8_t wy = ppu->window_line;
+      int start = memory[REG_WX] - 7;
+      for (int x = start < 0 ? 0 : start; x < LCD_WIDTH; x++) {
+        uint8_t wx = x - start;
+        uint8_t tile = memory[window_map + (wy / 8) * 32 + wx / 8];
+        indices[x] = tile_pixel(
+            memory, tile_address(lcdc, tile) + (wy & 7) * 2, wx & 7);
+      }
+    }
+  }
+
+  uint8_t bgp = memory[REG_BGP];
+  uint32_t *row = &frame(ppu)[ly * LCD_WIDTH];
+  for (int x = 0; x < LCD_WIDTH; x++)
+    row[x] = shades[(bgp >> (indices[x] * 2)) & 0x03];
+
+  if (lcdc & 0x02)
+    draw_sprites(ppu, row, indices);
+}
+
+static uint8_t cgb_tile_pixel(PPU *ppu, uint8_t attributes, uint16_t address,
+                              uint8_t x, uint8_t y) {
+  if (attributes & 0x40)
+    y = 7 - y;
+  if (attributes & 0x20)
+    x = 7 - x;
+  const uint8_t *data =
+      vram(ppu, (attributes >> 3) & 1) + (address - 0x8000) + y * 2;
+  uint8_t bit = 7 - x;
+  return ((data[1] >> bit) & 1) << 1 | ((data[0] >> bit) & 1);
+}
+
+// Objects are ordered by OAM index only and pick one of eight palettes
+static void draw_cgb_sprites(PPU *ppu, uint32_t *row, const uint8_t *indices,
+                             const uint8_t *bg_priority) {
+  uint8_t *memory = ppu->memory;
+  uint8_t ly = memory[REG_LY];
+  uint8_t lcdc = memory[REG_LCDC];
+  uint8_t height = lcdc & 0x04 ? 16 : 8;
+
+  for (int i = ppu->sprite_count - 1; i >= 0; i--) {
+    uint8_t *sprite = &memory[OAM + ppu->sprites[i] * 4];
+    int x = sprite[1] - 8;
+    uint8_t tile = sprite[2];
+    uint8_t flags = sprite[3];
+
+    uint8_t line = ly - (sprite[0] - 16);
+    if (flags & 0x40)
+      line = height - 1 - line;
+    if (height == 16)
+      tile &= 0xFE;
+
+    const uint8_t *bank = vram(ppu, (flags >> 3) & 1);
+    const uint8_t *data = bank + tile * 16 + line * 2;
+    const uint32_t *colors = ppu->colors[1] + (flags & 0x07) * 4;
+    for (int px = 0; px < 8; px++) {
+      int screen_x = x + px;
+      if (screen_x < 0 || screen_x >= LCD_WIDTH)
+        continue;
+
+      uint8_t bit = flags & 0x20 ? px : 7 - px;
+      uint8_t color = ((data[1] >> bit) & 1) << 1 | ((data[0] >> bit) & 1);
+      if (color == 0)
+        continue;
+      // LCDC bit 0 clear puts every object above the background
+      if (lcdc & 0x01 && indices[screen_x] != 0 &&
+          (flags & 0x80 || bg_priority[screen_x]))
+        continue;
+      row[screen_x] = colors[color];
+    }
+  }
+}
+
+// Tile numbers come from the bank 0 map, their attributes from the same
+// spot in bank 1
+static void draw_cgb_line(PPU *ppu) {
+  uint8_t *memory = ppu->memory;
+  uint8_t ly = memory[REG_LY];
+  uint8_t lcdc = memory[REG_LCDC];
+  const uint8_t *maps = vram(ppu, 0);
+  const uint8_t *attribute_maps = vram(ppu, 1);
+  uint8_t indices[LCD_WIDTH];
+  uint8_t bg_priority[LCD_WIDTH];
+  uint32_t *row = &frame(ppu)[ly * LCD_WIDTH];
+
+  uint16_t map = (lcdc & 0x08 ? 0x9C00 : 0x9800) - 0x8000;
+  uint8_t y = ly + memory[REG_SCY];
+  uint8_t scx = memory[REG_SCX];
+  for (int x = 0; x < LCD_WIDTH; x++) {
+    uint8_t bx = x + scx;
+    uint16_t offset = map + (y / 8) * 32 + bx / 8;
+    uint8_t attributes = attribute_maps[offset];
+    uint8_t color = cgb_tile_pixel(ppu, attributes,
+                                   tile_address(lcdc, maps[offset]), bx & 7,
+                                   y & 7);
+    indices[x] = color;
+    bg_priority[x] = attributes & 0x80;
+    row[x] = ppu->colors[0][(attributes & 0x07) * 4 + color];
+  }
+
+  if (window_visible(ppu)) {
+    uint16_t window_map = (lcdc & 0x40 ? 0x9C00 : 0x9800) - 0x8000;
+    uint8_t wy = ppu->window_line;
+    int start = memory[REG_WX] - 7;
+    for (int x = start < 0 ? 0 : start; x < LCD_WIDTH; x++) {
+      uint8_t wx = x - start;
+      uint16_t offset = window_map + (wy / 8) * 32 + wx / 8;
+      uint8_t attributes = attribute_maps[offset];
+      uint8_t color = cgb_tile_pixel(ppu, attributes,
+                                     tile_address(lcdc, maps[offset]), wx & 7,
+                                     wy & 7);
+      indices[x] = color;
+      bg_priority[x] = attributes & 0x80;
+      row[x] = ppu->colors[0][(attributes & 0x07) * 4 + color];
+    }
+  }
+
+  if (lcdc & 0x02)
+    draw_cgb_sprites(ppu, row, indices, bg_priority);
+}
+
+// Copy whole 16 byte blocks from the source into the mapped VRAM bank
+static void hdma_copy(PPU *ppu, uint32_t blocks) {
+  uint32_t size = blocks * HDMA_BLOCK;
+  if (ppu->hdma_destination + size > 0xA000)
+    size = 0xA000 - ppu->hdma_destination;
+  if (ppu->hdma_source + size > 0x10000)
+    size = 0x10000 - ppu->hdma_source;
+
+  uint8_t *destination =
+      vram(ppu, ppu->vram_bank) + (ppu->hdma_destination - 0x8000);
+  for (uint32_t i = 0; i < size; i++)
+    destination[i] = dma_read(ppu, ppu->hdma_source + i);
+  ppu->hdma_source += blocks * HDMA_BLOCK;
+  ppu->hdma_destination += blocks * HDMA_BLOCK;
+  if (ppu->hdma_destination >= 0xA000 || ppu->hdma_destination < 0x8000)
+    ppu->hdma_destination = 0x8000 | (ppu->hdma_destination & 0x1FF0);
+}
+
+static void enter_hblank(PPU *ppu) {
+  set_mode(ppu, MODE_HBLANK);
+  if (ppu->composing) {
+    if (ppu->cgb)
+      draw_cgb_line(ppu);
+    else
+      draw_line(ppu);
+  }
+  if (ppu->hdma_active) {
+    hdma_copy(ppu, 1);
+    if (ppu->bus != NULL)
+      ppu->bus->cycles += HDMA_BLOCK_CYCLES;
+    ppu->hdma_active = --ppu->hdma_blocks > 0;
+    ppu->memory[REG_HDMA5] = ppu->hdma_active ? ppu->hdma_blocks - 1 : 0xFF;
+  }
+  // The window keeps its own line counter, it must advance even when the
+  // frame is skipped
+  if (window_visible(ppu))
+    ppu->window_line++;
+}
+
+static uint16_t next_event(PPU *ppu) {
+  if (ppu->memory[REG_LY] >= VBLANK_LINE)
+    return LINE_CYCLES;
+  if (ppu->line_cycle < OAM_CYCLES)
+    return OAM_CYCLES;
+  if (ppu->line_cycle < OAM_CYCLES + ppu->mode3_length)
+    return OAM_CYCLES + ppu->mode3_length;
+  return LINE_CYCLES;
+}
+
+void ppu_set_target(PPU *ppu, uint32_t *target) {
+  ppu->target = target;
+  if (target != NULL && !(ppu->memory[REG_LCDC] & 0x80))
+    blank(target);
+}
+
+void ppu_init(PPU *ppu, uint8_t *memory, uint32_t *framebuffer) {
+  if (!rgb555_ready)
+    init_rgb555();
+
+  memset(ppu, 0, sizeof(PPU));
+  ppu->memory = memory;
+  ppu->framebuffer = framebuffer;
+  // Color palettes start out white
+  memset(ppu->palette_ram, 0xFF, sizeof(ppu->palette_ram));
+  for (int i = 0; i < 32; i++)
+    ppu->colors[0][i] = ppu->colors[1][i] = rgb555[0x7FFF];
+  ppu->render = 1;
+  ppu->mode3_length = MODE3_CYCLES;
+  if (framebuffer != NULL)
+    blank(framebuffer);
+}
+
+// Advance mode to mode instead of cycle by cycle
+void ppu_run_to(PPU *ppu, uint64_t cycle) {
+  uint8_t *memory = ppu->memory;
+  if (!(memory[REG_LCDC] & 0x80)) {
+    ppu->cycle = cycle;
+    return;
+  }
+
+  while (ppu->cycle < cycle) {
+    uint16_t event = next_event(ppu);
+    uint64_t remaining = cycle - ppu->cycle;
+    uint16_t advance = event - ppu->line_cycle;
+    if (advance > remaining)
+      advance = remaining;
+
+    ppu->line_cycle += advance;
+    ppu->cycle += advance;
+    if (ppu->line_cycle != event)
+      break;
+
+    if (event == LINE_CYCLES) {
+      ppu->line_cycle = 0;
+      memory[REG_LY] = (memory[REG_LY] + 1) % LINES;
+      start_line(ppu);
+    } else if (event == OAM_CYCLES) {
+      set_mode(ppu, MODE_TRANSFER);
+    } else {
+      enter_hblank(ppu);
+    }
+    update_stat(ppu);
+  }
+}
+
+void ppu_write(PPU *ppu, uint64_t cycle, uint16_t address, uint8_t value) {
+  ppu_run_to(ppu, cycle);
+
+  uint8_t *memory = ppu->memory;
+  switch (address) {
+  case REG_LY:
+    // Read only
+    break;
+  case REG_STAT:
+    memory[REG_STAT] = (memory[REG_STAT] & 0x87) | (value & 0x78);
+    update_stat(ppu);
+    break;
+  case REG_LYC:
+    memory[REG_LYC] = value;
+    update_stat(ppu);
+    break;
+  case REG_LCDC: {
+    uint8_t enabled = memory[REG_LCDC] & 0x80;
+    memory[REG_LCDC] = value;
+    if (enabled && !(value & 0x80)) {
+      // Whatever was presented last goes white, even in skipped frames
+      memory[REG_LY] = 0;
+      ppu->line_cycle = 0;
+      ppu->composing = 0;
+      set_mode(ppu, MODE_HBLANK);
+      blank(frame(ppu));
+    } else if (!enabled && (value & 0x80)) {
+      // The first frame after switching the LCD on is not shown, it stays
+      // white
+      ppu->line_cycle = 0;
+      start_line(ppu);
+      ppu->composing = 0;
+    }
+    update_stat(ppu);
+    break;
+  }
+  case REG_VBK:
+    if (ppu->cgb)
+      ppu->vram_bank = value & 0x01;
+    memory[REG_VBK] = 0xFE | ppu->vram_bank;
+    break;
+  case REG_BCPD:
+  case REG_OCPD: {
+    int objects = address == REG_OCPD;
+    uint16_t index_register = objects ? REG_OCPS : REG_BCPS;
+    uint8_t index = memory[index_register] & 0x3F;
+    uint8_t *ram = ppu->palette_ram[objects];
+    ram[index] = value;
+    ppu->colors[objects][index / 2] =
+        rgb555[(ram[index | 1] << 8 | ram[index & 0x3E]) & 0x7FFF];
+    // Bit 7 advances the index after every write
+    if (memory[index_register] & 0x80)
+      memory[index_register] = 0x80 | ((index + 1) & 0x3F);
+    break;
+  }
+  default:
+    if (address >= 0x8000 && address < 0xA000)
+      vram(ppu, ppu->vram_bank)[address - 0x8000] = value;
+    else
+      memory[address] = value;
+    break;
+  }
+}
+
+uint8_t ppu_read(PPU *ppu, uint64_t cycle, uint16_t address) {
+  ppu_run_to(ppu, cycle);
+
+  uint8_t *memory = ppu->memory;
+  switch (address) {
+  case REG_BCPD:
+    return ppu->palette_ram[0][memory[REG_BCPS] & 0x3F];
+  case REG_OCPD:
+    return ppu->palette_ram[1][memory[REG_OCPS] & 0x3F];
+  default:
+    return memory[address];
+  }
+}
+
+uint64_t ppu_frame_end(PPU *ppu, uint64_t cycle) {
+  ppu_run_to(ppu, cycle);
+  if (!(ppu->memory[REG_LCDC] & 0x80))
+    return cycle + LINES * LINE_CYCLES;
+  // Right at the start of V-blank the next one is a whole frame away
+  int lines = (VBLANK_LINE - ppu->memory[REG_LY] + LINES - 1) % LINES + 1;
+  return ppu->cycle + lines * LINE_CYCLES - ppu->line_cycle;
+}
+
+uint32_t ppu_start_hdma(PPU *ppu, uint64_t cycle, uint8_t value) {
+  ppu_run_to(ppu, cycle);
+
+  uint8_t *memory = ppu->memory;
+  // Writing bit 7 clear during an H-blank transfer stops it
+  if (ppu->hdma_active && !(value & 0x80)) {
+    ppu->hdma_active = 0;
+    memory[REG_HDMA5] = 0x80 | (ppu->hdma_blocks - 1);
+    return 0;
+  }
+
+  ppu->hdma_source = (memory[REG_HDMA1] << 8 | memory[REG_HDMA2]) & 0xFFF0;
+  ppu->hdma_destination =
+      0x8000 | ((memory[REG_HDMA3] << 8 | memory[REG_HDMA4]) & 0x1FF0);
+  uint32_t blocks = (value & 0x7F) + 1;
+
+  if (value & 0x80) {
+    ppu->hdma_active = 1;
+    ppu->hdma_blocks = blocks;
+    memory[REG_HDMA5] = blocks - 1;
+    return 0;
+  }
+
+  hdma_copy(ppu, blocks);
+  memory[REG_HDMA5] = 0xFF;
+  return blocks * HDMA_BLOCK_CYCLES;
+}
+
+int ppu_hdma_source(const PPU *ppu, uint16_t address) {
+  return ppu->hdma_active && address >= ppu->hdma_source &&
+         address < ppu->hdma_source + ppu->hdma_blocks * HDMA_BLOCK;
+}
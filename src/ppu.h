@@ -0,0 +1,80 @@
+#ifndef PPU_NEOSAHADEO
+#define PPU_NEOSAHADEO
+
+#include <inttypes.h>
+
+#define LCD_WIDTH 160
+#define LCD_HEIGHT 144
+#define MAX_LINE_SPRITES 10
+
+typedef struct PPU {
+  uint8_t *memory; // Full bus, VRAM, OAM and the LCD registers live here
+  // The CPU it belongs to, DMA sources are read through its bus. NULL reads
+  // them straight from memory.
+  struct CPU *bus;
+
+  // Like the APU the PPU is caught up lazily, on LCD register, VRAM and OAM
+  // accesses and at frame end
+  uint64_t cycle;
+  uint16_t line_cycle; // Position within the current line, 0 - 455
+  uint16_t mode3_length;
+  uint8_t window_line;
+  uint8_t stat_line; // Previous STAT interrupt line, for edge detection
+
+  // Cleared for frames that will not be presented. LY/STAT timing, OAM
+  // scan and interrupts still run, only pixel composition is skipped. It
+  // is latched into composing when a frame starts at line 0, so a frame is
+  // composed whole or not at all.
+  uint8_t render;
+  uint8_t composing;
+  // Rows are composed here instead of into framebuffer when set
+  uint32_t *target;
+
+  uint8_t sprite_count;
+  uint8_t sprites[MAX_LINE_SPRITES]; // OAM indices selected for this line
+
+  // Game Boy Color
+  uint8_t cgb;
+  uint8_t vram_bank;           // Bank the CPU sees at 0x8000
+  uint8_t vram1[0x2000];       // Bank 1, bank 0 always lives in memory
+  uint8_t palette_ram[2][64];  // Background and object RGB555 colors
+  uint32_t colors[2][32];      // The same, converted for the framebuffer
+
+  // H-blank DMA copies a 16 byte block at the start of every H-blank and
+  // stalls the CPU for it. Both happen when the PPU catches up, the stall
+  // is charged to the CPU then rather than at the H-blank itself.
+  uint8_t hdma_active;
+  uint8_t hdma_blocks; // Blocks left
+  uint16_t hdma_source;
+  uint16_t hdma_destination;
+
+  // LCD_WIDTH * LCD_HEIGHT pixels, 0xRRGGBBAA, owned by the caller
+  uint32_t *framebuffer;
+} PPU;
+
+// framebuffer is where frames go without a target. It may be NULL when it
+// is set before the PPU runs.
+void ppu_init(PPU *ppu, uint8_t *memory, uint32_t *framebuffer);
+void ppu_run_to(PPU *ppu, uint64_t cycle);
+void ppu_write(PPU *ppu, uint64_t cycle, uint16_t address, uint8_t value);
+uint8_t ppu_read(PPU *ppu, uint64_t cycle, uint16_t address);
+
+// Cycle at which the frame in progress is complete, when the PPU next
+// enters V-blank. With the LCD off it is a frame's worth of cycles away.
+uint64_t ppu_frame_end(PPU *ppu, uint64_t cycle);
+
+// Compose the next rendered frame straight into target, a host buffer of
+// LCD_WIDTH * LCD_HEIGHT pixels, NULL goes back to the framebuffer. Set it
+// before the frame starts: with the LCD off nothing is drawn, so the
+// target is blanked right away.
+void ppu_set_target(PPU *ppu, uint32_t *target);
+
+// Start a transfer through HDMA5. General purpose transfers happen at once
+// and return the cycles the CPU is stalled for, H-blank transfers return 0.
+uint32_t ppu_start_hdma(PPU *ppu, uint64_t cycle, uint8_t value);
+
+// Whether the H-blank transfer in progress has yet to read address. The
+// PPU must catch up before such a byte is written.
+int ppu_hdma_source(const PPU *ppu, uint16_t address);
+
+#endif
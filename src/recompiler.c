@@ -0,0 +1,488 @@
+#include "aot.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "utils.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Ahead of time recompiler.
+//
+// Walks the code reachable from the entry point and the interrupt vectors
+// using the decode tables and writes a C file with one function per basic
+// block. The output links against the core like any other source file:
+//
+//   ./recompiler -o aot_program.c game.gb
+//
+// Anything the walk can not see, code reached through RET or JP HL into
+// addresses no static branch targets, RAM and unimplemented opcodes, is
+// left to the interpreter at run time.
+
+#define MAX_BLOCK_INSTRUCTIONS 64
+
+typedef struct Walker {
+  uint8_t *rom;
+  size_t rom_size;
+  size_t banks;
+
+  // One entry per address of every 16 KiB window: 0x0000 - 0x3FFF for bank
+  // 0, 0x4000 - 0x7FFF for the others
+  uint8_t *leaders;
+  uint32_t *worklist;
+  size_t worklist_count;
+} Walker;
+
+static const uint16_t roots[] = {0x0100, 0x0040, 0x0048, 0x0050, 0x0058,
+                                 0x0060};
+
+static size_t slot(size_t bank, uint16_t address) {
+  return bank * ROM_BANK_SIZE + address % ROM_BANK_SIZE;
+}
+
+// ROM byte at address with bank mapped, -1 outside the ROM
+static int rom_byte(Walker *walker, size_t bank, uint32_t address) {
+  size_t offset = bank * ROM_BANK_SIZE + address % ROM_BANK_SIZE;
+  if (offset >= walker->rom_size)
+    return -1;
+  return walker->rom[offset];
+}
+
+static void add_leader(Walker *walker, size_t bank, uint32_t address) {
+  if (address >= 2 * ROM_BANK_SIZE)
+    return;
+  if (address < ROM_BANK_SIZE) {
+    bank = 0;
+  } else if (bank == 0) {
+    // Bank 0 can not know which bank is selected, follow the target into
+    // all of them
+    for (size_t i = 1; i < walker->banks; i++)
+      add_leader(walker, i, address);
+    return;
+  }
+
+  size_t index = slot(bank, address);
+  if (walker->leaders[index])
+    return;
+  walker->leaders[index] = 1;
+  walker->worklist[walker->worklist_count++] = index;
+}
+
+// Decoded length of the instruction at address, 0 when it has to be left
+// to the interpreter
+static int decode(Walker *walker, size_t bank, uint32_t address,
+                  uint8_t *bytes) {
+  int opcode = rom_byte(walker, bank, address);
+  if (opcode < 0 || opcode_table[opcode] == not_implemented)
+    return 0;
+
+  int length = opcode_lengths[opcode];
+  uint32_t window_end = bank == 0 ? ROM_BANK_SIZE : 2 * ROM_BANK_SIZE;
+  if (address + length > window_end)
+    return 0;
+
+  for (int i = 0; i < length; i++) {
+    int value = rom_byte(walker, bank, address + i);
+    if (value < 0)
+      return 0;
+    bytes[i] = value;
+  }
+  if (opcode == 0xCB && special_opcode_table[bytes[1]] == not_implemented)
+    return 0;
+  return length;
+}
+
+static uint16_t branch_target(const uint8_t *bytes, uint32_t next) {
+  if (opcode_lengths[bytes[0]] == 2)
+    return next + (int8_t)bytes[1];
+  return bytes[2] << 8 | bytes[1];
+}
+
+static void walk(Walker *walker) {
+  for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++)
+    add_leader(walker, 0, roots[i]);
+
+  while (walker->worklist_count > 0) {
+    size_t index = walker->worklist[--walker->worklist_count];
+    size_t bank = index / ROM_BANK_SIZE;
+    uint32_t address = index % ROM_BANK_SIZE + (bank ? ROM_BANK_SIZE : 0);
+
+    uint8_t bytes[3] = {0};
+    int length;
+    while ((length = decode(walker, bank, address, bytes)) > 0) {
+      uint32_t next = address + length;
+      uint8_t flow = opcode_flow[bytes[0]];
+
+      switch (FLOW_KIND(flow)) {
+      case FLOW_NONE:
+        address = next;
+        continue;
+      case FLOW_JUMP:
+        add_leader(walker, bank, branch_target(bytes, next));
+        break;
+      case FLOW_CALL:
+        add_leader(walker, bank, branch_target(bytes, next));
+        add_leader(walker, bank, next);
+        break;
+      case FLOW_RESTART:
+        add_leader(walker, 0, bytes[0] & 0x38);
+        add_leader(walker, bank, next);
+        break;
+      case FLOW_BARRIER:
+        add_leader(walker, bank, next);
+        break;
+      }
+      if (flow & FLOW_CONDITIONAL)
+        add_leader(walker, bank, next);
+      break;
+    }
+  }
+}
+
+static void emit_bytes(FILE *out, uint32_t address, const uint8_t *bytes,
+                       int length) {
+  fprintf(out, "  // %04X:", address);
+  for (int i = 0; i < length; i++)
+    fprintf(out, " %02X", bytes[i]);
+  fprintf(out, "\n");
+}
+
+static void emit_cycles(FILE *out, uint32_t *pending) {
+  if (*pending > 0)
+    fprintf(out, "  cpu->cycles += %u;\n", *pending);
+  *pending = 0;
+}
+
+static const char *pair_name(uint8_t opcode) {
+  static const char *pairs[] = {"bc", "de", "hl", "af"};
+  return pairs[(opcode >> 4) & 3];
+}
+
+// Register only instructions, emitted as plain C on the block's locals
+static int emit_register_op(FILE *out, const uint8_t *bytes) {
+  uint16_t word = bytes[2] << 8 | bytes[1];
+  switch (bytes[0]) {
+  case 0x00:
+    return 1;
+  case 0x05:
+    fprintf(out, "  { uint8_t r = (bc >> 8) - 1; bc = (bc & 0x00FF) | r << 8; "
+                 "af = (af & 0xFF1F) | (r == 0) << 7 | 0x40 | "
+                 "((r & 0x0F) == 0x0F) << 5; }\n");
+    return 1;
+  case 0x06:
+    fprintf(out, "  bc = (bc & 0x00FF) | 0x%02X00;\n", bytes[1]);
+    return 1;
+  case 0x0C:
+    fprintf(out, "  { uint8_t r = bc + 1; bc = (bc & 0xFF00) | r; "
+                 "af = (af & 0xFF1F) | (r == 0) << 7 | "
+                 "((r & 0x0F) == 0) << 5; }\n");
+    return 1;
+  case 0x0E:
+    fprintf(out, "  bc = (bc & 0xFF00) | 0x%02X;\n", bytes[1]);
+    return 1;
+  case 0x11:
+  case 0x21:
+  case 0x31:
+    fprintf(out, "  %s = 0x%04X;\n",
+            bytes[0] == 0x31 ? "sp" : pair_name(bytes[0]), word);
+    return 1;
+  case 0x17:
+    fprintf(out, "  { uint8_t a = af >> 8; "
+                 "af = (uint8_t)(a << 1 | (af >> 4 & 1)) << 8 | (af & 0x0F) | "
+                 "(a >> 7) << 4; }\n");
+    return 1;
+  case 0x23:
+    fprintf(out, "  hl++;\n");
+    return 1;
+  case 0x3E:
+    fprintf(out, "  af = (af & 0x00FF) | 0x%02X00;\n", bytes[1]);
+    return 1;
+  case 0x4F:
+    fprintf(out, "  bc = (bc & 0xFF00) | af >> 8;\n");
+    return 1;
+  case 0xAF:
+    fprintf(out, "  af = (af & 0x000F) | 0x80;\n");
+    return 1;
+  case 0xCB:
+    switch (bytes[1]) {
+    case 0x11:
+      fprintf(out, "  { uint8_t c = bc; uint8_t r = c << 1 | (af >> 4 & 1); "
+                   "bc = (bc & 0xFF00) | r; "
+                   "af = (af & 0xFF0F) | (r == 0) << 7 | (c >> 7) << 4; }\n");
+      return 1;
+    case 0x7C:
+      fprintf(out, "  af = (af & 0xFF1F) | (hl & 0x8000 ? 0x00 : 0x80) | "
+                   "0x20;\n");
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+// Loads and stores go straight to the bus, with the cycle count brought up
+// to date first so the PPU and APU catch up to the right point
+static int emit_memory_op(FILE *out, const uint8_t *bytes,
+                          uint32_t *pending) {
+  switch (bytes[0]) {
+  case 0x1A:
+  case 0x22:
+  case 0x32:
+  case 0x77:
+  case 0xC1:
+  case 0xC5:
+  case 0xD5:
+  case 0xE5:
+  case 0xF5:
+  case 0xE0:
+  case 0xE2:
+    break;
+  default:
+    return 0;
+  }
+
+  emit_cycles(out, pending);
+  switch (bytes[0]) {
+  case 0x1A:
+    fprintf(out, "  af = mmu_read(cpu, de) << 8 | (af & 0x00FF);\n");
+    return 1;
+  case 0x22:
+    fprintf(out, "  mmu_write(cpu, hl++, af >> 8);\n");
+    return 1;
+  case 0x32:
+    fprintf(out, "  mmu_write(cpu, hl--, af >> 8);\n");
+    return 1;
+  case 0x77:
+    fprintf(out, "  mmu_write(cpu, hl, af >> 8);\n");
+    return 1;
+  case 0xC1:
+    fprintf(out, "  { uint8_t low = mmu_read(cpu, sp++); "
+                 "bc = mmu_read(cpu, sp++) << 8 | low; }\n");
+    return 1;
+  case 0xC5:
+  case 0xD5:
+  case 0xE5:
+  case 0xF5:
+    fprintf(out, "  mmu_write(cpu, --sp, %s >> 8);\n", pair_name(bytes[0]));
+    fprintf(out, "  mmu_write(cpu, --sp, %s & 0xFF);\n", pair_name(bytes[0]));
+    return 1;
+  case 0xE0:
+    fprintf(out, "  mmu_write(cpu, 0xFF%02X, af >> 8);\n", bytes[1]);
+    return 1;
+  case 0xE2:
+    fprintf(out, "  mmu_write(cpu, 0xFF00 | (bc & 0xFF), af >> 8);\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Instructions that end a block. Returns 0 for those left to the handler.
+static int emit_branch(FILE *out, const uint8_t *bytes, uint32_t next,
+                       uint32_t *pending) {
+  switch (bytes[0]) {
+  case 0x20:
+    fprintf(out, "  if (!(af & 0x80))\n    EXIT(0x%04X, %u);\n",
+            branch_target(bytes, next), *pending + 4);
+    fprintf(out, "  EXIT(0x%04X, %u);\n", next, *pending);
+    return 1;
+  case 0xC9:
+    emit_cycles(out, pending);
+    fprintf(out, "  { uint8_t low = mmu_read(cpu, sp++); "
+                 "uint16_t target = mmu_read(cpu, sp++) << 8 | low; "
+                 "EXIT(target, 0); }\n");
+    return 1;
+  case 0xCD:
+    emit_cycles(out, pending);
+    fprintf(out, "  mmu_write(cpu, --sp, 0x%02X);\n", next >> 8);
+    fprintf(out, "  mmu_write(cpu, --sp, 0x%02X);\n", next & 0xFF);
+    fprintf(out, "  EXIT(0x%04X, 0);\n", branch_target(bytes, next));
+    return 1;
+  case 0xFB:
+    fprintf(out, "  cpu->ime = 1;\n");
+    fprintf(out, "  EXIT(0x%04X, %u);\n", next, *pending);
+    return 1;
+  }
+  return 0;
+}
+
+// Everything else calls the interpreter's handler with the state synced
+static void emit_handler_call(FILE *out, const uint8_t *bytes,
+                              uint32_t address, uint32_t *pending) {
+  fprintf(out, "  SYNC();\n  cpu->PC = 0x%04X;\n", (address + 1) & 0xFFFF);
+  emit_cycles(out, pending);
+  fprintf(out, "  opcode_table[0x%02X](cpu);\n", bytes[0]);
+  if (opcode_flow[bytes[0]] != FLOW_NONE)
+    fprintf(out, "  return;\n");
+  else
+    fprintf(out, "  LOAD();\n");
+}
+
+static void emit_block(Walker *walker, FILE *out, size_t bank,
+                       uint32_t start, uint16_t *instructions) {
+  fprintf(out, "static void block_%02zX_%04X(CPU *cpu) {\n", bank, start);
+  fprintf(out, "  uint16_t af, bc, de, hl, sp;\n  LOAD();\n");
+
+  // Cycles of register only instructions are added in bulk
+  uint32_t address = start;
+  uint32_t pending = 0;
+  int count = 0;
+  int length;
+  uint8_t bytes[3] = {0};
+  while (count < MAX_BLOCK_INSTRUCTIONS &&
+         (length = decode(walker, bank, address, bytes)) > 0) {
+    uint8_t opcode = bytes[0];
+    uint32_t next = address + length;
+    count++;
+    emit_bytes(out, address, bytes, length);
+
+    pending += opcode_cycles[opcode];
+    if (opcode_flow[opcode] != FLOW_NONE) {
+      if (!emit_branch(out, bytes, next, &pending))
+        emit_handler_call(out, bytes, address, &pending);
+      fprintf(out, "}\n\n");
+      *instructions = count;
+      return;
+    }
+
+    if (emit_register_op(out, bytes)) {
+      if (opcode == 0xCB)
+        pending += special_opcode_cycles[bytes[1]];
+    } else if (!emit_memory_op(out, bytes, &pending)) {
+      emit_handler_call(out, bytes, address, &pending);
+    }
+
+    // Falling into another leader ends the block, it has its own function
+    address = next;
+    uint32_t window_end = bank == 0 ? ROM_BANK_SIZE : 2 * ROM_BANK_SIZE;
+    if (address < window_end && walker->leaders[slot(bank, address)])
+      break;
+  }
+
+  fprintf(out, "  EXIT(0x%04X, %u);\n}\n\n", address, pending);
+  *instructions = count;
+}
+
+static const char prelude[] =
+    "// Generated by the recompiler, do not edit\n"
+    "#include \"aot.h\"\n"
+    "#include \"cpu.h\"\n"
+    "#include \"mmu.h\"\n"
+    "\n"
+    "#define LOAD() (af = cpu->AF, bc = cpu->BC, de = cpu->DE, hl = cpu->HL, "
+    "sp = cpu->SP)\n"
+    "#define SYNC() (cpu->AF = af, cpu->BC = bc, cpu->DE = de, cpu->HL = hl, "
+    "cpu->SP = sp)\n"
+    "#define EXIT(pc, count) \\\n"
+    "  do { \\\n"
+    "    SYNC(); \\\n"
+    "    cpu->PC = (pc); \\\n"
+    "    cpu->cycles += (count); \\\n"
+    "    return; \\\n"
+    "  } while (0)\n"
+    "\n";
+
+static size_t emit_program(Walker *walker, FILE *out) {
+  fputs(prelude, out);
+
+  uint16_t *instructions = calloc(walker->banks * ROM_BANK_SIZE,
+                                  sizeof(uint16_t));
+  if (instructions == NULL) {
+    perror("Failed to allocate block table.");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t count = 0;
+  for (size_t index = 0; index < walker->banks * ROM_BANK_SIZE; index++) {
+    if (!walker->leaders[index])
+      continue;
+    size_t bank = index / ROM_BANK_SIZE;
+    uint32_t address = index % ROM_BANK_SIZE + (bank ? ROM_BANK_SIZE : 0);
+    uint8_t bytes[3] = {0};
+    if (decode(walker, bank, address, bytes) == 0)
+      continue;
+    emit_block(walker, out, bank, address, &instructions[index]);
+    count++;
+  }
+
+  fprintf(out, "static const AotBlock blocks[] = {\n");
+  for (size_t index = 0; index < walker->banks * ROM_BANK_SIZE; index++) {
+    if (instructions[index] == 0)
+      continue;
+    size_t bank = index / ROM_BANK_SIZE;
+    uint32_t address = index % ROM_BANK_SIZE + (bank ? ROM_BANK_SIZE : 0);
+    fprintf(out, "    {%zu, 0x%04X, %u, block_%02zX_%04X},\n", bank, address,
+            instructions[index], bank, address);
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out,
+          "const AotProgram aot_program = {0x%08X, %zu, blocks,\n"
+          "                                sizeof(blocks) / sizeof(blocks[0])};\n",
+          aot_rom_hash(walker->rom, walker->rom_size), walker->banks);
+
+  free(instructions);
+  return count;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "Usage: %s [-o output.c] <rom>\n", program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  const char *output = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc)
+    usage(argv[0]);
+
+  Walker walker;
+  memset(&walker, 0, sizeof(walker));
+  if (read_to_buffer(argv[optind], &walker.rom, &walker.rom_size) != 0) {
+    fprintf(stderr, "Failed to read %s.\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  // ROMs without banking still have their second half at 0x4000 as bank 1
+  walker.banks = walker.rom_size / ROM_BANK_SIZE;
+  if (walker.banks < 2)
+    walker.banks = 2;
+  walker.leaders = calloc(walker.banks * ROM_BANK_SIZE, sizeof(uint8_t));
+  walker.worklist = calloc(walker.banks * ROM_BANK_SIZE, sizeof(uint32_t));
+  if (walker.leaders == NULL || walker.worklist == NULL) {
+    perror("Failed to allocate the code walker.");
+    exit(EXIT_FAILURE);
+  }
+
+  walk(&walker);
+
+  FILE *out = output != NULL ? fopen(output, "w") : stdout;
+  if (out == NULL) {
+    perror("Failed to open the output file.");
+    exit(EXIT_FAILURE);
+  }
+  size_t blocks = emit_program(&walker, out);
+  if (out != stdout)
+    fclose(out);
+
+  if (blocks == 0) {
+    fprintf(stderr, "No reachable code was found.\n");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(stderr, "%zu blocks from %zu banks\n", blocks, walker.banks);
+
+  free(walker.leaders);
+  free(walker.worklist);
+  free(walker.rom);
+  return 0;
+}
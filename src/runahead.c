@@ -0,0 +1,154 @@
+#include "runahead.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static void *worker(void *arg) {
+  RunAhead *runahead = arg;
+  CPU *ahead = &runahead->ahead;
+
+  pthread_mutex_lock(&runahead->lock);
+  for (;;) {
+    while (!runahead->requested && !runahead->quit)
+      pthread_cond_wait(&runahead->wake, &runahead->lock);
+    if (runahead->quit)
+      break;
+    runahead->requested = 0;
+    pthread_mutex_unlock(&runahead->lock);
+
+    // The snapshot carries the input the main context just used
+    state_load(ahead, &runahead->snapshot);
+    int frames = runahead->job_frames;
+    for (int i = 0; i < frames; i++) {
+      pthread_mutex_lock(&runahead->lock);
+      int cancel = runahead->cancel;
+      pthread_mutex_unlock(&runahead->lock);
+      if (cancel)
+        break;
+      runahead->ppu.render = i == frames - 1;
+      run_frame(ahead);
+    }
+
+    pthread_mutex_lock(&runahead->lock);
+    runahead->finished = 1;
+    pthread_cond_signal(&runahead->done);
+  }
+  pthread_mutex_unlock(&runahead->lock);
+  return NULL;
+}
+
+RunAhead *runahead_create(const CPU *cpu, int frames) {
+  RunAhead *runahead = calloc(1, sizeof(RunAhead));
+  uint8_t *memory = calloc(65536, sizeof(uint8_t)); // 64KiB
+  uint8_t *sram = NULL;
+  if (cpu->sram != NULL)
+    sram = calloc(cpu->sram_size, sizeof(uint8_t));
+  uint8_t(*wram_banks)[WRAM_BANK_SIZE] = NULL;
+  if (cpu->cgb)
+    wram_banks = calloc(WRAM_BANKS, WRAM_BANK_SIZE);
+  if (runahead == NULL || memory == NULL ||
+      (cpu->sram != NULL && sram == NULL) ||
+      (cpu->cgb && wram_banks == NULL)) {
+    perror("Failed to allocate the run-ahead context.");
+    free(runahead);
+    free(memory);
+    free(sram);
+    free(wram_banks);
+    return NULL;
+  }
+  runahead->frames = frames;
+  runahead->finished = 1;
+  runahead->speculative = 0;
+
+  // No sound comes out of the second context, its channels still run so
+  // NR52 reads the same as in the main one
+  initialize_cpu(&runahead->ahead, memory);
+  ppu_init(&runahead->ppu, memory, runahead->framebuffer);
+  apu_init(&runahead->apu, memory + 0xFF10, NULL);
+  runahead->ahead.ppu = &runahead->ppu;
+  runahead->ppu.bus = &runahead->ahead;
+  runahead->ahead.apu = &runahead->apu;
+  runahead->ahead.sram = sram;
+  runahead->ahead.sram_size = sram != NULL ? cpu->sram_size : 0;
+  runahead->ahead.wram_banks = wram_banks;
+
+  pthread_mutex_init(&runahead->lock, NULL);
+  pthread_cond_init(&runahead->wake, NULL);
+  pthread_cond_init(&runahead->done, NULL);
+  if (pthread_create(&runahead->thread, NULL, worker, runahead) != 0) {
+    fprintf(stderr, "Failed to start the run-ahead worker.\n");
+    free(memory);
+    free(sram);
+    free(wram_banks);
+    free(runahead);
+    return NULL;
+  }
+  return runahead;
+}
+
+void runahead_destroy(RunAhead *runahead) {
+  if (runahead == NULL)
+    return;
+
+  pthread_mutex_lock(&runahead->lock);
+  runahead->quit = 1;
+  pthread_cond_signal(&runahead->wake);
+  pthread_mutex_unlock(&runahead->lock);
+  pthread_join(runahead->thread, NULL);
+
+  pthread_mutex_destroy(&runahead->lock);
+  pthread_cond_destroy(&runahead->wake);
+  pthread_cond_destroy(&runahead->done);
+  // The cartridge belongs to the main context
+  free(runahead->ahead.memory);
+  free(runahead->ahead.sram);
+  free(runahead->ahead.wram_banks);
+  free(runahead);
+}
+
+static void wait_idle(RunAhead *runahead) {
+  pthread_mutex_lock(&runahead->lock);
+  while (!runahead->finished)
+    pthread_cond_wait(&runahead->done, &runahead->lock);
+  runahead->cancel = 0;
+  pthread_mutex_unlock(&runahead->lock);
+}
+
+static void start(RunAhead *runahead, const CPU *cpu, int frames,
+                  int speculative) {
+  wait_idle(runahead);
+
+  // The worker is idle, it only reads the snapshot after being woken
+  state_save(cpu, &runahead->snapshot);
+  runahead->job_frames = frames;
+  runahead->job_cycles = cpu->cycles;
+  runahead->job_joypad = cpu->joypad;
+  runahead->speculative = speculative;
+
+  pthread_mutex_lock(&runahead->lock);
+  runahead->finished = 0;
+  runahead->requested = 1;
+  pthread_cond_signal(&runahead->wake);
+  pthread_mutex_unlock(&runahead->lock);
+}
+
+void runahead_speculate(RunAhead *runahead, const CPU *cpu) {
+  // One more frame, the main context has not run the next one yet
+  start(runahead, cpu, runahead->frames + 1, 1);
+}
+
+const CPU *runahead_frame(RunAhead *runahead, const CPU *cpu,
+                          uint64_t start_cycles) {
+  pthread_mutex_lock(&runahead->lock);
+  int guessed = runahead->speculative &&
+                runahead->job_cycles == start_cycles &&
+                runahead->job_joypad == cpu->joypad;
+  if (!guessed && !runahead->finished)
+    runahead->cancel = 1;
+  pthread_mutex_unlock(&runahead->lock);
+
+  if (!guessed)
+    start(runahead, cpu, runahead->frames, 0);
+  wait_idle(runahead);
+  runahead->speculative = 0;
+  return &runahead->ahead;
+}
@@ -0,0 +1,68 @@
+#ifndef RUNAHEAD_NEOSAHADEO
+#define RUNAHEAD_NEOSAHADEO
+
+#include "apu.h"
+#include "cpu.h"
+#include "ppu.h"
+#include "state.h"
+#include <pthread.h>
+
+#define MAX_RUNAHEAD_FRAMES 8
+
+// Run-ahead hides the frames of input lag games have internally.
+//
+// The main context emulates every frame once, with sound and without
+// composing pixels. A second context on a worker thread runs `frames`
+// further frames from its state with the same input and renders the last
+// one, that is what gets presented. The main context never rolls back, so
+// its audio stays continuous.
+//
+// Right after presenting, the worker speculates that the input stays held.
+// It starts from the main context's state and runs the next main frame plus
+// the frames ahead, overlapping the pacing wait, the input poll and the next
+// main frame. When the input did not change its frame is ready at present
+// time. Otherwise it is cancelled and the run-ahead is done after the main
+// frame, as without speculation.
+typedef struct RunAhead {
+  int frames;
+
+  CPU ahead;
+  PPU ppu;
+  APU apu;
+  uint32_t framebuffer[LCD_WIDTH * LCD_HEIGHT];
+  Snapshot snapshot; // Written by the main thread while the worker is idle
+
+  // The job handed to the worker
+  int job_frames;
+  uint64_t job_cycles; // Main context cycles the snapshot was taken at
+  uint8_t job_joypad;
+  int speculative;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  int requested;
+  int finished;
+  int cancel;
+  int quit;
+} RunAhead;
+
+// NULL when the worker can not be started. The second context gets
+// cartridge RAM the size of the loaded cartridge's, not backed by its file,
+// and WRAM banks when the cartridge is a CGB one.
+RunAhead *runahead_create(const CPU *cpu, int frames);
+void runahead_destroy(RunAhead *runahead);
+
+// Let the worker run ahead of the main context's state assuming the
+// current input is still held for the next frame
+void runahead_speculate(RunAhead *runahead, const CPU *cpu);
+
+// Returns the context whose frame to present after the main context ran
+// the frame that started at start_cycles. Waits for the speculation when
+// it guessed that frame right, otherwise runs ahead from the current
+// state. The context stays as it is until the next speculation.
+const CPU *runahead_frame(RunAhead *runahead, const CPU *cpu,
+                          uint64_t start_cycles);
+
+#endif
@@ -1,2 +1,114 @@
+#include "screen.h"
+#include "cpu.h"
 #include <SDL3/SDL.h>
 #include <SDL3/SDL_init.h>
+#include <stdint.h>
+#include <stdio.h>
+
+static SDL_Window *window;
+static SDL_Renderer *renderer;
+static SDL_Texture *texture;
+
+// Returns 0 on success, the emulator keeps running headless otherwise
+int screen_open(int vsync) {
+  if (!SDL_InitSubSystem(SDL_INIT_VIDEO)) {
+    fprintf(stderr, "Failed to initialize video: %s\n", SDL_GetError());
+    return -1;
+  }
+
+  if (!SDL_CreateWindowAndRenderer("GameBoy", SCREEN_WIDTH * SCREEN_SCALE,
+                                   SCREEN_HEIGHT * SCREEN_SCALE, 0, &window,
+                                   &renderer)) {
+    fprintf(stderr, "Failed to create window: %s\n", SDL_GetError());
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
+    return -1;
+  }
+
+  // Without vsync support the caller falls back to sleeping
+  if (vsync && !SDL_SetRenderVSync(renderer, 1)) {
+    fprintf(stderr, "Failed to enable vsync: %s\n", SDL_GetError());
+    screen_close();
+    return -1;
+  }
+
+  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
+                              SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH,
+                              SCREEN_HEIGHT);
+  if (texture == NULL) {
+    fprintf(stderr, "Failed to create texture: %s\n", SDL_GetError());
+    screen_close();
+    return -1;
+  }
+  SDL_SetTextureScaleMode(texture, SDL_SCALEMODE_NEAREST);
+  return 0;
+}
+
+// Returns 0 once the window has been closed
+int screen_poll(void) {
+  SDL_Event event;
+  while (SDL_PollEvent(&event)) {
+    if (event.type == SDL_EVENT_QUIT)
+      return 0;
+  }
+  return 1;
+}
+
+// Fast-forward runs while Tab is held
+int screen_fast_forward_held(void) {
+  if (window == NULL)
+    return 0;
+  return SDL_GetKeyboardState(NULL)[SDL_SCANCODE_TAB];
+}
+
+// Arrows for the d-pad, X and Z for A and B, Right Shift and Return for
+// Select and Start
+uint8_t screen_joypad(void) {
+  if (window == NULL)
+    return 0;
+
+  const bool *keys = SDL_GetKeyboardState(NULL);
+  uint8_t pressed = 0;
+  if (keys[SDL_SCANCODE_RIGHT])
+    pressed |= JOYPAD_RIGHT;
+  if (keys[SDL_SCANCODE_LEFT])
+    pressed |= JOYPAD_LEFT;
+  if (keys[SDL_SCANCODE_UP])
+    pressed |= JOYPAD_UP;
+  if (keys[SDL_SCANCODE_DOWN])
+    pressed |= JOYPAD_DOWN;
+  if (keys[SDL_SCANCODE_X])
+    pressed |= JOYPAD_A;
+  if (keys[SDL_SCANCODE_Z])
+    pressed |= JOYPAD_B;
+  if (keys[SDL_SCANCODE_RSHIFT])
+    pressed |= JOYPAD_SELECT;
+  if (keys[SDL_SCANCODE_RETURN])
+    pressed |= JOYPAD_START;
+  return pressed;
+}
+
+// Pixels are 0xRRGGBBAA, NULL presents a blank screen
+void screen_present(const uint32_t *pixels) {
+  if (renderer == NULL)
+    return;
+
+  SDL_RenderClear(renderer);
+  if (pixels != NULL) {
+    SDL_UpdateTexture(texture, NULL, pixels, SCREEN_WIDTH * sizeof(uint32_t));
+    SDL_RenderTexture(renderer, texture, NULL, NULL);
+  }
+  SDL_RenderPresent(renderer);
+}
+
+void screen_close(void) {
+  if (texture != NULL)
+    SDL_DestroyTexture(texture);
+  if (renderer != NULL)
+    SDL_DestroyRenderer(renderer);
+  if (window != NULL)
+    SDL_DestroyWindow(window);
+  texture = NULL;
+  renderer = NULL;
+  window = NULL;
+  SDL_QuitSubSystem(SDL_INIT_VIDEO);
+}
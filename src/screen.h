@@ -1,3 +1,17 @@
 #ifndef SCREEN_NEOSAHADEO
 #define SCREEN_NEOSAHADEO
+
+#include <inttypes.h>
+
+#define SCREEN_WIDTH 160
+#define SCREEN_HEIGHT 144
+#define SCREEN_SCALE 4
+
+int screen_open(int vsync);
+int screen_poll(void);
+int screen_fast_forward_held(void);
+uint8_t screen_joypad(void); // JOYPAD_* bits of the keys held
+void screen_present(const uint32_t *pixels);
+void screen_close(void);
+
 #endif
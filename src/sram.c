@@ -0,0 +1,95 @@
+#include "sram.h"
+#include "mmu.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HEADER_TYPE 0x147
+#define HEADER_RAM_SIZE 0x149
+
+size_t sram_size(const uint8_t *rom, size_t rom_size) {
+  if (rom == NULL || rom_size <= HEADER_RAM_SIZE)
+    return 0;
+
+  // MBC3 and MBC5 bank RAM and the clock through registers the MMU does
+  // not have, their saves would come out scrambled
+  switch (rom[HEADER_TYPE]) {
+  case 0x03: // MBC1+RAM+BATTERY
+  case 0x09: // ROM+RAM+BATTERY
+    break;
+  default:
+    return 0;
+  }
+
+  switch (rom[HEADER_RAM_SIZE]) {
+  case 0x02:
+    return 8 * 1024;
+  case 0x03:
+    return SRAM_MAX_SIZE;
+  default:
+    return 0;
+  }
+}
+
+int sram_open(CPU *cpu, const char *path) {
+  size_t size = sram_size(cpu->rom, cpu->rom_size);
+  if (size == 0)
+    return -1;
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    perror("Failed to open the save file.");
+    return -1;
+  }
+
+  // Two instances writing one mapping would interleave their saves
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    fprintf(stderr, "Save file %s is in use, running without it.\n", path);
+    close(fd);
+    return -1;
+  }
+
+  // New and short files are padded with zeros, longer ones keep their tail
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      ((size_t)st.st_size < size && ftruncate(fd, size) != 0)) {
+    perror("Failed to size the save file.");
+    close(fd);
+    return -1;
+  }
+
+  uint8_t *sram = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (sram == MAP_FAILED) {
+    perror("Failed to map the save file.");
+    close(fd);
+    return -1;
+  }
+
+  // The descriptor holds the lock until sram_close
+  cpu->sram_fd = fd;
+  cpu->sram = sram;
+  cpu->sram_size = size;
+  cpu->sram_dirty = 0;
+  return 0;
+}
+
+void sram_flush(CPU *cpu) {
+  if (cpu->sram == NULL || !cpu->sram_dirty)
+    return;
+  msync(cpu->sram, cpu->sram_size, MS_ASYNC);
+  cpu->sram_dirty = 0;
+}
+
+void sram_close(CPU *cpu) {
+  if (cpu->sram == NULL)
+    return;
+  munmap(cpu->sram, cpu->sram_size);
+  if (cpu->sram_fd >= 0)
+    close(cpu->sram_fd);
+  cpu->sram = NULL;
+  cpu->sram_fd = -1;
+  cpu->sram_size = 0;
+}
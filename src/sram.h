@@ -0,0 +1,28 @@
+#ifndef SRAM_NEOSAHADEO
+#define SRAM_NEOSAHADEO
+
+#include "cpu.h"
+
+// Battery backed cartridge RAM lives in a MAP_SHARED mapping of the .sav
+// file, every write the game makes lands in the page cache right away.
+// Nothing is written out on exit and a crash loses nothing the kernel has
+// already seen.
+
+// Size of the cartridge RAM declared in the header, 0 when the cartridge
+// has no battery to keep it or banks it with a controller other than MBC1,
+// the only one the MMU emulates
+size_t sram_size(const uint8_t *rom, size_t rom_size);
+
+// Map the save file for the loaded cartridge, creating or growing it as
+// needed. The file stays locked while it is mapped so a second instance
+// can't write the same save. Returns -1 when the cartridge has no battery
+// RAM or the file can't be locked or mapped, 0xA000 - 0xBFFF then stays
+// plain memory.
+int sram_open(CPU *cpu, const char *path);
+
+// Start writeback of what the game wrote since the last call without
+// waiting for it, cheap enough for every frame boundary
+void sram_flush(CPU *cpu);
+void sram_close(CPU *cpu);
+
+#endif
@@ -0,0 +1,84 @@
+#include "state.h"
+#include "jit.h"
+#include "mmu.h"
+#include <stddef.h>
+#include <string.h>
+
+#define PPU_STATE_SIZE offsetof(PPU, framebuffer)
+#define APU_STATE_SIZE offsetof(APU, synthesize)
+
+// The cartridge RAM bank currently mapped at 0xA000
+static uint8_t *sram_window(const CPU *cpu) {
+  return cpu->sram + (cpu->sram_bank * SRAM_BANK_SIZE) % cpu->sram_size;
+}
+
+void state_save(const CPU *cpu, Snapshot *snapshot) {
+  snapshot->cpu = *cpu;
+  memcpy(snapshot->memory, cpu->memory, sizeof(snapshot->memory));
+  if (cpu->sram != NULL) {
+    memcpy(snapshot->sram, cpu->sram, cpu->sram_size);
+    memcpy(snapshot->memory + 0xA000, sram_window(cpu), SRAM_BANK_SIZE);
+  }
+  if (cpu->cgb && cpu->wram_banks != NULL)
+    memcpy(snapshot->wram_banks, cpu->wram_banks, sizeof(snapshot->wram_banks));
+  if (cpu->ppu != NULL)
+    memcpy(&snapshot->ppu, cpu->ppu, PPU_STATE_SIZE);
+  if (cpu->apu != NULL)
+    memcpy(&snapshot->apu, cpu->apu, APU_STATE_SIZE);
+}
+
+void state_load(CPU *cpu, const Snapshot *snapshot) {
+  CPU host = *cpu;
+
+  *cpu = snapshot->cpu;
+  cpu->memory = host.memory;
+  cpu->ppu = host.ppu;
+  cpu->apu = host.apu;
+  cpu->serial_out = host.serial_out;
+  cpu->jit = host.jit;
+  cpu->aot = host.aot;
+  cpu->debugger = host.debugger;
+  cpu->watch_pages = host.watch_pages;
+  cpu->sram = host.sram;
+  cpu->sram_size = host.sram_size;
+  cpu->sram_fd = host.sram_fd;
+  cpu->wram_banks = host.wram_banks;
+  memcpy(cpu->memory, snapshot->memory, sizeof(snapshot->memory));
+  if (cpu->cgb && cpu->wram_banks != NULL && snapshot->cpu.wram_banks != NULL)
+    memcpy(cpu->wram_banks, snapshot->wram_banks, sizeof(snapshot->wram_banks));
+
+  // Contexts without cartridge RAM run on the copy in the memory map. A
+  // snapshot taken without it only has that bank to give.
+  if (cpu->sram != NULL) {
+    if (snapshot->cpu.sram != NULL && snapshot->cpu.sram_size == cpu->sram_size)
+      memcpy(cpu->sram, snapshot->sram, cpu->sram_size);
+    else
+      memcpy(sram_window(cpu), snapshot->memory + 0xA000, SRAM_BANK_SIZE);
+    cpu->sram_dirty = 1;
+  }
+
+  if (cpu->ppu != NULL && snapshot->cpu.ppu != NULL) {
+    uint8_t render = cpu->ppu->render;
+    uint32_t *target = cpu->ppu->target;
+    memcpy(cpu->ppu, &snapshot->ppu, PPU_STATE_SIZE);
+    cpu->ppu->memory = cpu->memory;
+    cpu->ppu->bus = cpu;
+    cpu->ppu->render = render;
+    cpu->ppu->target = target;
+  }
+
+  if (cpu->apu != NULL && snapshot->cpu.apu != NULL) {
+    // Finish the old timeline's samples, then line synthesis up with the
+    // restored channels
+    APU *apu = cpu->apu;
+    int synthesize = apu->synthesize;
+    apu_set_synthesis(apu, 0, apu->cycle);
+    memcpy(apu, &snapshot->apu, APU_STATE_SIZE);
+    apu->registers = cpu->memory + 0xFF10;
+    apu_set_synthesis(apu, synthesize, apu->cycle);
+  }
+
+  // Every byte of RAM may have changed under the compiled blocks
+  if (cpu->jit != NULL)
+    jit_invalidate(cpu->jit, 0x0000, 0x10000);
+}
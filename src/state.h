@@ -0,0 +1,32 @@
+#ifndef STATE_NEOSAHADEO
+#define STATE_NEOSAHADEO
+
+#include "apu.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "ppu.h"
+
+// Save states kept in memory. Saving and loading are plain copies into
+// storage the caller owns, nothing is allocated, so they are cheap enough
+// to run every frame.
+typedef struct Snapshot {
+  CPU cpu;
+  uint8_t memory[0x10000];
+  uint8_t sram[SRAM_MAX_SIZE]; // Every cartridge RAM bank, cpu.sram_size long
+  uint8_t wram_banks[WRAM_BANKS][WRAM_BANK_SIZE]; // CGB only
+
+  // Only the parts up to the framebuffer and the synthesis state are kept,
+  // what is on screen and already in the audio ring is output, not state
+  PPU ppu;
+  APU apu;
+} Snapshot;
+
+void state_save(const CPU *cpu, Snapshot *snapshot);
+
+// The CPU keeps its own memory, PPU, APU, serial hook, engines, debugger and
+// save file, only their contents are replaced. That includes the CGB WRAM
+// banks, a CGB snapshot needs a context that has them. Contexts without cartridge
+// RAM of their own only get the bank mapped at 0xA000, in the memory map.
+void state_load(CPU *cpu, const Snapshot *snapshot);
+
+#endif
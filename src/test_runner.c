@@ -0,0 +1,331 @@
+#include "aot.h"
+#include "cpu.h"
+#include "jit.h"
+#include "mmu.h"
+#include "utils.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Headless conformance runner for Blargg and Mooneye test ROMs.
+//
+// Every ROM runs in its own forked process so a crash or an unimplemented
+// opcode only fails that ROM. Results are written into a shared mapping
+// which the parent reports once all workers have finished.
+
+#define DEFAULT_TIMEOUT_SECONDS 120
+#define SERIAL_BUFFER_SIZE 4096
+#define MAX_ROMS 1024
+
+#define OPCODE_LD_B_B 0x40 // Mooneye software breakpoint
+
+typedef enum {
+  RESULT_PENDING,
+  RESULT_PASS,
+  RESULT_FAIL,
+  RESULT_TIMEOUT,
+  RESULT_CRASH,
+} ResultStatus;
+
+typedef enum {
+  ENGINE_INTERPRETER,
+  ENGINE_JIT,
+  ENGINE_JIT_VERIFY, // JIT checked against the interpreter per instruction
+  ENGINE_AOT,        // Blocks translated by the recompiler, see build-aot
+} Engine;
+
+#ifdef AOT_PROGRAM
+extern const AotProgram aot_program;
+#endif
+
+typedef struct TestResult {
+  char name[256];
+  ResultStatus status;
+  uint64_t cycles;
+  uint16_t pc;
+  uint8_t opcode; // Last opcode fetched before a crash
+  int signal;     // Signal that killed the worker, 0 when it exited
+  pid_t pid;
+  long long elapsed_ns;
+  size_t serial_len;
+  char serial[SERIAL_BUFFER_SIZE];
+} TestResult;
+
+// Per process state of the ROM being run, used by the serial and exit hooks
+static TestResult *current_result;
+static CPU *current_cpu;
+static long long start_ns;
+
+static void record_state(void) {
+  current_result->cycles = current_cpu->cycles;
+  current_result->pc = current_cpu->PC;
+  current_result->elapsed_ns = current_time_ns() - start_ns;
+}
+
+// Runs on an unimplemented opcode, and from exit() when the worker gives up
+// before the ROM finished
+static void record_crash(void) {
+  if (current_result->status != RESULT_PENDING)
+    return;
+  current_result->status = RESULT_CRASH;
+  current_result->opcode = mmu_read(current_cpu, current_cpu->PC - 1);
+  record_state();
+}
+
+// Blargg ROMs print their verdict over the serial port
+static void capture_serial(CPU *cpu, uint8_t value) {
+  (void)cpu;
+  TestResult *result = current_result;
+  if (result->serial_len + 1 >= SERIAL_BUFFER_SIZE)
+    return;
+
+  result->serial[result->serial_len++] = value;
+  result->serial[result->serial_len] = '\0';
+
+  if (value != '\n')
+    return;
+  if (strstr(result->serial, "Passed") != NULL)
+    result->status = RESULT_PASS;
+  else if (strstr(result->serial, "Failed") != NULL)
+    result->status = RESULT_FAIL;
+}
+
+// Mooneye ROMs execute LD B, B with a Fibonacci sequence in the registers
+// on success and 0x42 in every register on failure
+static ResultStatus mooneye_signature(CPU *cpu) {
+  if (cpu->BC == 0x0305 && cpu->DE == 0x080D && cpu->HL == 0x1522)
+    return RESULT_PASS;
+  return RESULT_FAIL;
+}
+
+static void run_rom(const char *path, TestResult *result, uint64_t max_cycles,
+                    Engine engine) {
+  CPU cpu;
+  uint8_t *memory = calloc(65536, sizeof(uint8_t)); // 64KiB
+  initialize_cpu(&cpu, memory);
+
+  uint8_t *rom = NULL;
+  size_t rom_size = 0;
+  read_to_buffer(path, &rom, &rom_size);
+  load_cartridge(&cpu, rom, rom_size);
+  post_boot_state(&cpu);
+  cpu.serial_out = capture_serial;
+  if (engine == ENGINE_JIT || engine == ENGINE_JIT_VERIFY) {
+    cpu.jit = jit_create(engine == ENGINE_JIT_VERIFY);
+    if (cpu.jit == NULL)
+      exit(EXIT_FAILURE);
+  }
+#ifdef AOT_PROGRAM
+  // Only the ROM the program was made from runs translated, every other
+  // ROM in the directory is interpreted
+  if (engine == ENGINE_AOT)
+    cpu.aot = aot_create(&cpu, &aot_program);
+#endif
+
+  current_result = result;
+  current_cpu = &cpu;
+  start_ns = current_time_ns();
+  atexit(record_crash);
+
+  while (result->status == RESULT_PENDING) {
+    if (cpu.cycles >= max_cycles) {
+      result->status = RESULT_TIMEOUT;
+      break;
+    }
+    // Blargg ROMs may run LD B, B too, they report over serial instead
+    if (result->serial_len == 0 && mmu_read(&cpu, cpu.PC) == OPCODE_LD_B_B) {
+      result->status = mooneye_signature(&cpu);
+      break;
+    }
+    // LD B, B is never compiled, blocks always stop in front of it
+    if (cpu.aot != NULL)
+      aot_step(&cpu);
+    else if (cpu.jit != NULL)
+      jit_step(&cpu);
+    else
+      step(&cpu);
+    if (cpu.fault) {
+      record_crash();
+      break;
+    }
+  }
+
+  record_state();
+  aot_destroy(cpu.aot);
+  jit_destroy(cpu.jit);
+  destroy_cpu(&cpu);
+}
+
+static int has_rom_extension(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot != NULL && (strcmp(dot, ".gb") == 0 || strcmp(dot, ".gbc") == 0);
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(((const TestResult *)a)->name, ((const TestResult *)b)->name);
+}
+
+static const char *status_name(ResultStatus status) {
+  switch (status) {
+  case RESULT_PASS:
+    return "PASS";
+  case RESULT_FAIL:
+    return "FAIL";
+  case RESULT_TIMEOUT:
+    return "TIMEOUT";
+  case RESULT_CRASH:
+    return "CRASH";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+// Workers killed by a signal never reach the exit hook, report them from
+// their wait status
+static void reap_worker(TestResult *results, size_t count) {
+  int status;
+  pid_t pid = wait(&status);
+  if (pid == -1 || !WIFSIGNALED(status))
+    return;
+  for (size_t i = 0; i < count; i++) {
+    if (results[i].pid != pid)
+      continue;
+    results[i].status = RESULT_CRASH;
+    results[i].signal = WTERMSIG(status);
+    break;
+  }
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [-j jobs] [-t seconds] "
+          "[-e interpreter|jit|jit-verify|aot] <rom directory>\n",
+          program);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  long timeout_seconds = DEFAULT_TIMEOUT_SECONDS;
+  Engine engine = ENGINE_INTERPRETER;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:t:e:")) != -1) {
+    switch (opt) {
+    case 'j':
+      jobs = strtol(optarg, NULL, 10);
+      break;
+    case 't':
+      timeout_seconds = strtol(optarg, NULL, 10);
+      break;
+    case 'e':
+      if (strcmp(optarg, "interpreter") == 0)
+        engine = ENGINE_INTERPRETER;
+      else if (strcmp(optarg, "jit") == 0)
+        engine = ENGINE_JIT;
+      else if (strcmp(optarg, "jit-verify") == 0)
+        engine = ENGINE_JIT_VERIFY;
+#ifdef AOT_PROGRAM
+      else if (strcmp(optarg, "aot") == 0)
+        engine = ENGINE_AOT;
+#endif
+      else
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc)
+    usage(argv[0]);
+  if (jobs < 1)
+    jobs = 1;
+
+  const char *directory = argv[optind];
+  uint64_t max_cycles = (uint64_t)timeout_seconds * CPU_CLOCK_HZ;
+
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    perror("Failed to open test ROM directory.");
+    exit(EXIT_FAILURE);
+  }
+
+  TestResult *results = mmap(NULL, MAX_ROMS * sizeof(TestResult),
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                             -1, 0);
+  if (results == MAP_FAILED) {
+    perror("Failed to map test results.");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL && count < MAX_ROMS) {
+    if (!has_rom_extension(entry->d_name))
+      continue;
+    snprintf(results[count].name, sizeof(results[count].name), "%s",
+             entry->d_name);
+    count++;
+  }
+  closedir(dir);
+  qsort(results, count, sizeof(TestResult), compare_names);
+
+  long long suite_start = current_time_ns();
+  long running = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (running == jobs) {
+      reap_worker(results, count);
+      running--;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+      perror("Failed to fork test worker.");
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      // Keep unimplemented opcode messages out of the report
+      freopen("/dev/null", "w", stdout);
+
+      char path[4096];
+      snprintf(path, sizeof(path), "%s/%s", directory, results[i].name);
+      run_rom(path, &results[i], max_cycles, engine);
+      exit(EXIT_SUCCESS);
+    }
+    results[i].pid = pid;
+    running++;
+  }
+  while (running > 0) {
+    reap_worker(results, count);
+    running--;
+  }
+  long long suite_elapsed = current_time_ns() - suite_start;
+
+  size_t passed = 0;
+  for (size_t i = 0; i < count; i++) {
+    TestResult *result = &results[i];
+    printf("%-8s %-40s %12" PRIu64 " cycles %10.2f ms", status_name(result->status),
+           result->name, result->cycles, result->elapsed_ns / 1e6);
+    if (result->status == RESULT_CRASH && result->signal != 0)
+      printf("  (%s)", strsignal(result->signal));
+    else if (result->status == RESULT_CRASH)
+      printf("  (PC=%04x, opcode %02x)", result->pc, result->opcode);
+    printf("\n");
+
+    if (result->status == RESULT_PASS)
+      passed++;
+    else if (result->serial_len > 0)
+      printf("%s\n", result->serial);
+  }
+  printf("\n%zu/%zu passed in %.2f ms (%ld jobs)\n", passed, count,
+         suite_elapsed / 1e6, jobs);
+
+  munmap(results, MAX_ROMS * sizeof(TestResult));
+  return passed == count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 int read_to_buffer(const char *filename, uint8_t **buffer, size_t *size) {
@@ -25,9 +26,23 @@ int read_to_buffer(const char *filename, uint8_t **buffer, size_t *size) {
     exit(EXIT_FAILURE);
   }
 
+  if (*buffer == NULL) {
+    *buffer = malloc(sb.st_size);
+    if (*buffer == NULL) {
+      perror("Failed to allocate file buffer.");
+      exit(EXIT_FAILURE);
+    }
+  }
+
   read(fd, *buffer, sb.st_size);
   close(fd);
 
   *size = sb.st_size;
   return 0;
 }
+
+long long current_time_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
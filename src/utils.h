@@ -4,6 +4,8 @@
 #include <inttypes.h>
 #include <unistd.h>
 
+// Allocates *buffer when it is NULL, otherwise it must fit the whole file
 int read_to_buffer(const char *filename, uint8_t **buffer, size_t *size);
+long long current_time_ns();
 
 #endif